@@ -0,0 +1,351 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "reader.hpp"
+#include "replay.hpp"
+#include "trace_gen.hpp"
+
+/* what one benchmark processed, filled in by the child process */
+struct Result {
+  uint64_t items = 0;
+  uint64_t bytes = 0;
+  double seconds = 0;
+  long rss_kb = 0;
+};
+
+/* replays prepared actions so that merge is measured without parsing */
+class VectorSource : public GetAction {
+  std::vector<Action> actions;
+  size_t pos = 0;
+public:
+  VectorSource(std::vector<Action> &&a): actions(std::move(a)) {}
+  virtual Action next_action() {
+    return pos < actions.size() ? actions[pos++] : Action();
+  }
+};
+
+static double timed(const std::function<void()> &fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t drain(GetAction *g) {
+  uint64_t n = 0;
+  while (g->next_action().inst != Action::END) n++;
+  return n;
+}
+
+static std::vector<Action> parse(const std::string &file) {
+  std::vector<Action> ret;
+  FileReader fr(file);
+  for (auto a = fr.next_action(); a.inst != Action::END; a = fr.next_action())
+    ret.push_back(a);
+  return ret;
+}
+
+static uint64_t file_size(const std::string &file) {
+  struct stat st;
+  return stat(file.c_str(), &st) ? 0 : st.st_size;
+}
+
+/* runs body in a child so that peak RSS belongs to this benchmark only */
+static bool run(const std::string &name, const std::function<void(Result &)> &body) {
+  int fds[2];
+  if (pipe(fds)) return false;
+  auto pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    Result r;
+    body(r);
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    r.rss_kb = ru.ru_maxrss;
+    if (write(fds[1], &r, sizeof(r)) != sizeof(r)) _exit(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  Result r;
+  bool ok = pid > 0 && read(fds[0], &r, sizeof(r)) == sizeof(r);
+  close(fds[0]);
+  int status = 0;
+  if (pid > 0) waitpid(pid, &status, 0);
+  if (!ok) {
+    std::cerr << name << ": failed" << std::endl;
+    return false;
+  }
+  char line[256];
+  snprintf(line, sizeof(line), "%-20s %12lu %9.3f %14.0f %9.1f %10.1f",
+           name.c_str(), r.items, r.seconds,
+           r.seconds > 0 ? r.items / r.seconds : 0,
+           r.seconds > 0 ? r.bytes / r.seconds / (1 << 20) : 0,
+           r.rss_kb / 1024.0);
+  std::cout << line << std::endl;
+  return true;
+}
+
+enum {
+  OPT_THREADS = 256, OPT_CPUS, OPT_DEPTH, OPT_FANOUT, OPT_UNKNOWN, OPT_BREAK,
+  OPT_PAUSE, OPT_SEED, OPT_FILTER, OPT_KEEP, OPT_IO_DIRECT
+};
+
+static const struct option long_options[] = {
+  {"threads", required_argument, nullptr, OPT_THREADS},
+  {"cpus", required_argument, nullptr, OPT_CPUS},
+  {"depth", required_argument, nullptr, OPT_DEPTH},
+  {"fanout", required_argument, nullptr, OPT_FANOUT},
+  {"unknown", required_argument, nullptr, OPT_UNKNOWN},
+  {"break", required_argument, nullptr, OPT_BREAK},
+  {"pause", required_argument, nullptr, OPT_PAUSE},
+  {"seed", required_argument, nullptr, OPT_SEED},
+  {"filter", required_argument, nullptr, OPT_FILTER},
+  {"keep", no_argument, nullptr, OPT_KEEP},
+  {"io-direct", no_argument, nullptr, OPT_IO_DIRECT},
+  {nullptr, 0, nullptr, 0}
+};
+
+int main(int argc, char *argv[]) {
+  TraceGen::Config cfg;
+  size_t lines = 1000000;
+  size_t jobs = 4;
+  size_t read_step = 10000;
+  std::string dir = "/tmp/pt_flame_bench";
+  std::string filter = "";
+  bool keep = false;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:j:s:d:", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'n': lines = std::stoul(optarg); break;
+    case 'j': jobs = std::stoul(optarg); break;
+    case 's': read_step = std::stoul(optarg); break;
+    case 'd': dir = optarg; break;
+    case OPT_THREADS: cfg.threads = std::stoul(optarg); break;
+    case OPT_CPUS: cfg.cpus = std::stoul(optarg); break;
+    case OPT_DEPTH: cfg.depth = std::stoul(optarg); break;
+    case OPT_FANOUT: cfg.fanout = std::stoul(optarg); break;
+    case OPT_UNKNOWN: cfg.unknown_rate = std::stod(optarg); break;
+    case OPT_BREAK: cfg.break_rate = std::stod(optarg); break;
+    case OPT_PAUSE: cfg.pause_rate = std::stod(optarg); break;
+    case OPT_SEED: cfg.seed = std::stoull(optarg); break;
+    case OPT_FILTER: filter = optarg; break;
+    case OPT_KEEP: keep = true; break;
+    case OPT_IO_DIRECT: block_options.direct = true; break;
+    default:
+      std::cerr <<
+      "Usage: pt_flame_bench [-n lines] [-j jobs] [-s read_step] [-d dir]\n"
+      "  -n <num> trace lines, default 1000000\n"
+      "  -j <num> workers of StreamReader and ParallelReader, default 4\n"
+      "  -s <num> read step, as in pt_flame, default 10000\n"
+      "  -d <dir> where generated traces are written, default /tmp/pt_flame_bench\n"
+      "\n  Generator Options: \n"
+      "  --threads <num> --cpus <num> default 16 threads on 4 cpus\n"
+      "  --depth <num> max stack depth, default 24\n"
+      "  --fanout <num> distinct callees per stack level, default 8\n"
+      "  --unknown <rate> calls into [unknown] frames, default 0.02\n"
+      "  --break <rate> trace breaks, default 0.0005\n"
+      "  --pause <rate> tr end/tr strt pairs, default 0.002\n"
+      "  --seed <num> default 1, same seed produces same trace\n"
+      "\n  Run Options: \n"
+      "  --filter <str> run benchmarks with name containing str only\n"
+      "  --keep keep generated traces\n"
+      "  --io-direct read traces with O_DIRECT, to measure cold storage\n";
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  mkdir(dir.c_str(), 0755);
+  std::vector<std::string> files;
+
+  /* one time ordered trace, also split into sequential chunks */
+  auto trace = dir + "/trace";
+  std::vector<std::string> chunks;
+  {
+    std::ofstream of(trace);
+    TraceGen gen(cfg);
+    for (size_t i = 0; i < jobs; ++i) {
+      std::ostringstream os;
+      gen.write(os, lines / jobs + (i < lines % jobs));
+      chunks.push_back(dir + "/chunk_" + std::to_string(i));
+      std::ofstream(chunks.back()) << os.str();
+      of << os.str();
+    }
+  }
+  files.push_back(trace);
+  files.insert(files.end(), chunks.begin(), chunks.end());
+
+  /* same number of lines split into independent time ordered streams */
+  std::vector<size_t> stream_counts;
+  std::map<size_t, std::vector<std::string>> streams;
+  for (size_t n = 1; n <= 8 && n <= cfg.threads; n *= 2) {
+    stream_counts.push_back(n);
+    for (size_t i = 0; i < n; ++i) {
+      auto name = dir + "/stream_" + std::to_string(n) + "_" + std::to_string(i);
+      std::ofstream of(name);
+      TraceGen(cfg, i, n).write(of, lines / n);
+      streams[n].push_back(name);
+      files.push_back(name);
+    }
+  }
+
+  auto bytes = file_size(trace);
+  std::cout << "trace: " << lines << " lines, " << (bytes >> 20) << " MB, "
+            << cfg.threads << " threads, seed " << cfg.seed << std::endl;
+  char header[256];
+  snprintf(header, sizeof(header), "%-20s %12s %9s %14s %9s %10s",
+           "benchmark", "items", "seconds", "items/s", "MB/s", "peak_rss_MB");
+  std::cout << header << std::endl;
+
+  size_t failed = 0;
+  auto bench = [&](const std::string &name,
+                   const std::function<void(Result &)> &body) {
+    if (name.find(filter) != std::string::npos && !run(name, body)) failed++;
+  };
+
+  bench("reader/basic", [&](Result &r) {
+    std::ifstream is(trace);
+    BasicReader br(&is);
+    r.seconds = timed([&]() { r.items = drain(&br); });
+    r.bytes = bytes;
+  });
+  std::vector<std::pair<std::string, BlockSource::Engine>> engines = {
+    {"uring", BlockSource::URING}, {"pread", BlockSource::PREAD},
+    {"ifstream", BlockSource::IFSTREAM}
+  };
+  for (auto &[engine_name, engine]: engines) {
+    bench("reader/file/" + engine_name, [&](Result &r) {
+      block_options.engine = engine;
+      FileReader fr(trace);
+      r.seconds = timed([&]() { r.items = drain(&fr); });
+      r.bytes = bytes;
+    });
+  }
+  bench("reader/stream", [&](Result &r) {
+    r.seconds = timed([&]() {
+      StreamReader sr(chunks, jobs, read_step);
+      r.items = drain(&sr);
+    });
+    r.bytes = bytes;
+  });
+  bench("reader/parallel", [&](Result &r) {
+    r.seconds = timed([&]() {
+      ParallelReader pr(trace, jobs);
+      r.items = drain(&pr);
+    });
+    r.bytes = bytes;
+  });
+
+  for (auto n: stream_counts) {
+    bench("merge/" + std::to_string(n), [&](Result &r) {
+      std::vector<GetAction *> srcs;
+      for (auto &f: streams[n]) srcs.push_back(new VectorSource(parse(f)));
+      MergeWrapper mw(srcs);
+      r.seconds = timed([&]() {
+        while (mw.next_action_by_block().inst != Action::END) r.items++;
+      });
+      for (auto s: srcs) delete s;
+    });
+  }
+
+  /* same user only trace, per action cost of kernel mitigations */
+  std::vector<std::pair<std::string, Replay::Mode>> modes = {
+    {"replay/auto", Replay::AUTO}, {"replay/user", Replay::USER},
+    {"replay/kernel", Replay::KERNEL}
+  };
+  for (auto &[name, mode]: modes) {
+    bench(name, [&](Result &r) {
+      auto actions = parse(trace);
+      Replay rp(mode);
+      r.seconds = timed([&]() {
+        for (auto &a: actions) rp.replay(a);
+        rp.cleanup();
+      });
+      r.items = actions.size();
+    });
+  }
+
+  /* stacks of all threads sampled every 10 us of trace, see --pmp */
+  bench("replay/pmp", [&](Result &r) {
+    auto actions = parse(trace);
+    Replay rp;
+    StackSamples samples(10000);
+    rp.sample_stacks(&samples);
+    r.seconds = timed([&]() {
+      for (auto &a: actions) rp.replay(a);
+      rp.cleanup();
+    });
+    r.items = actions.size();
+  });
+
+  /* cut every 1 ms of trace as --slice, fails unless the merged tree is
+     the same as without cuts */
+  bench("replay/slice", [&](Result &r) {
+    auto actions = parse(trace);
+    auto folded = [&](bool slice) {
+      Replay rp;
+      auto replay = [&]() {
+        Time end = 0;
+        for (auto &a: actions) {
+          if (slice && a.ts >= end) {
+            if (end) delete rp.cut(end);
+            end = a.ts - a.ts % 1000000 + 1000000;
+          }
+          rp.replay(a);
+        }
+        rp.cleanup();
+      };
+      if (slice) r.seconds = timed(replay);
+      else replay();
+      std::unique_ptr<Func> root(rp.destructive_merge_all());
+      std::ostringstream os;
+      if (root) root->flame_graph(os);
+      return os.str();
+    };
+    r.items = actions.size();
+    if (folded(true) != folded(false)) {
+      std::cerr << "replay/slice: merged tree changed by cuts" << std::endl;
+      _exit(1);
+    }
+  });
+
+  /* items are Func nodes folded into the merged tree */
+  bench("merge_funcs", [&](Result &r) {
+    Replay rp;
+    for (auto &a: parse(trace)) rp.replay(a);
+    rp.cleanup();
+    Metrics::func_count.publish();
+    r.items = metrics.funcs_allocated - metrics.funcs_freed;
+    r.seconds = timed([&]() { rp.destructive_merge_all(); });
+  });
+
+  bench("folded", [&](Result &r) {
+    Replay rp;
+    for (auto &a: parse(trace)) rp.replay(a);
+    rp.cleanup();
+    auto root = rp.destructive_merge_all();
+    std::ostringstream os;
+    r.seconds = timed([&]() { root->flame_graph(os); });
+    auto out = os.str();
+    r.bytes = out.size();
+    for (auto c: out) r.items += c == '\n';
+  });
+
+  if (!keep)
+    for (auto &f: files) unlink(f.c_str());
+  return failed ? 1 : 0;
+}
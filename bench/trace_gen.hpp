@@ -0,0 +1,129 @@
+#ifndef __TRACE_GEN_HEADER__
+#define __TRACE_GEN_HEADER__
+
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/* deterministic synthetic perf script output, same config and seed always
+   produce the same lines. threads are partitioned between streams so that
+   each stream is ordered by time, like per-cpu traces */
+class TraceGen {
+public:
+  struct Config {
+    size_t threads = 16;
+    size_t cpus = 4;
+    size_t depth = 24; /* max stack depth */
+    size_t fanout = 8; /* distinct callees per level */
+    double unknown_rate = 0.02; /* calls into [unknown] frames */
+    double break_rate = 0.0005; /* trace breaks, replay restarts thread */
+    double pause_rate = 0.002; /* tr end/tr strt pairs */
+    uint64_t seed = 1;
+  };
+
+private:
+  struct Thread {
+    size_t tid;
+    size_t cpu;
+    std::vector<size_t> stack; /* function index per level */
+    bool in_unknown = false;
+    bool paused = false;
+  };
+
+  Config cfg;
+  std::mt19937_64 rng;
+  std::vector<Thread> threads;
+  uint64_t ts = 1000000000000UL;
+  char buf[512];
+
+  double uniform() {
+    return std::uniform_real_distribution<double>(0, 1)(rng);
+  }
+  size_t pick(size_t n) { return rng() % n; }
+
+  static uint64_t address(size_t level, size_t index) {
+    return 0x400000 + (level * 64 + index) * 0x100;
+  }
+  std::string frame(size_t level, size_t index, uint64_t off) {
+    char s[128];
+    snprintf(s, sizeof(s), "%lx l%zu_f%zu+0x%lx (bench)",
+             address(level, index) + off, level, index, off);
+    return s;
+  }
+  std::string top(Thread &t, uint64_t off) {
+    return frame(t.stack.size() - 1, t.stack.back(), off);
+  }
+
+  void line(std::ostream &os, Thread &t, const char *inst,
+            const std::string &from, const std::string &to) {
+    int n = snprintf(buf, sizeof(buf), "%zu [%03zu] %lu.%09lu:   %s  %s => %s\n",
+                     t.tid, t.cpu, ts / 1000000000, ts % 1000000000, inst,
+                     from.c_str(), to.c_str());
+    os.write(buf, n);
+  }
+
+  void step(std::ostream &os, Thread &t) {
+    static const std::string unknown = "7f0000001000 [unknown] ([unknown])";
+    static const std::string zero = "0 [unknown] ([unknown])";
+    if (t.paused) {
+      /* resume at the address trace stopped */
+      t.paused = false;
+      line(os, t, "tr strt", zero, top(t, 0x30));
+      return;
+    }
+    if (t.in_unknown) {
+      t.in_unknown = false;
+      line(os, t, "return", unknown, top(t, 0x15));
+      return;
+    }
+    auto r = uniform();
+    if (r < cfg.break_rate) {
+      /* lost data, trace restarts somewhere unrelated */
+      size_t f = pick(cfg.fanout);
+      t.stack = {0, f};
+      line(os, t, "tr strt", zero, top(t, 0));
+      return;
+    }
+    if (r < cfg.break_rate + cfg.pause_rate) {
+      t.paused = true;
+      line(os, t, "tr end", top(t, 0x30), zero);
+      return;
+    }
+    bool can_ret = t.stack.size() > 1;
+    if (can_ret && (t.stack.size() >= cfg.depth || uniform() < 0.5)) {
+      auto from = top(t, 0x20);
+      t.stack.pop_back();
+      line(os, t, "return", from, top(t, 0x15));
+      return;
+    }
+    if (uniform() < cfg.unknown_rate) {
+      t.in_unknown = true;
+      line(os, t, "call", top(t, 0x10), unknown);
+      return;
+    }
+    auto from = top(t, 0x10);
+    t.stack.push_back(pick(cfg.fanout));
+    line(os, t, "call", from, top(t, 0));
+  }
+
+public:
+  TraceGen(const Config &cfg, size_t stream = 0, size_t streams = 1)
+  : cfg(cfg), rng(cfg.seed * 1000003 + stream) {
+    for (size_t i = stream; i < cfg.threads; i += streams)
+      threads.push_back({1000 + i, i % cfg.cpus, {0}});
+  }
+
+  /* appends lines to os, threads are picked at random */
+  void write(std::ostream &os, size_t lines) {
+    if (threads.empty()) return;
+    for (size_t i = 0; i < lines; ++i) {
+      ts += 1 + pick(50);
+      step(os, threads[pick(threads.size())]);
+    }
+  }
+};
+
+#endif
@@ -21,6 +21,7 @@ CUSTOM_FLAME=
 FILTER=
 
 DRY=
+BUILTIN=
 
 while [[ $# -gt 0 ]]; do
     case $1 in
@@ -106,10 +107,13 @@ if [[ -z $SKIP ]]; then
     else
         if [[ -z $PERF_BIN ]]; then
             if [[ -z $PARALLEL_PERF ]]; then
-                echo "parallel perf not found, did you install pt_func_perf?"
-                exit 255
+                # pt_flame runs stock perf script in parallel by itself
+                echo "parallel perf not found, use pt_flame --perf-data"
+                BUILTIN=1
+                PERF_BIN=$SYSTEM_PERF
+            else
+                PERF_BIN=$PARALLEL_PERF
             fi
-            PERF_BIN=$PARALLEL_PERF
         fi
     fi
 
@@ -134,13 +138,17 @@ if [[ -z $SKIP ]]; then
         script_cmd="$script_cmd --parallel $PARALLEL --parallel-prefix ${parallel_prefix}"
     fi
 
-    echo $script_cmd
-    if [[ -z $DRY ]]; then
-        eval $script_cmd
+    if [[ -z $BUILTIN ]]; then
+        echo $script_cmd
+        if [[ -z $DRY ]]; then
+            eval $script_cmd
+        fi
     fi
 fi
 
-if [[ $PARALLEL == 0 ]]; then
+if [[ -n $BUILTIN ]]; then
+    pt_cmd="$PT_BIN --perf-data $PERF_DATA --perf $PERF_BIN --perf-jobs $PARALLEL --perf-args \"$perf_param\" $CUSTOM_FLAME"
+elif [[ $PARALLEL == 0 ]]; then
     pt_cmd="$PT_BIN $CUSTOM_FLAME ${parallel_prefix}*"
 else
     pt_cmd="$PT_BIN -j $PARALLEL $CUSTOM_FLAME ${parallel_prefix}*"
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""Read span file written by pt_flame --spans and print matching spans as CSV.
+
+Usage: pt_spans.py [--tid tid] [--symbol regex] [--min-duration ns] <file>
+"""
+
+import argparse
+import csv
+import re
+import struct
+import sys
+import zlib
+
+
+def read_varints(data, count):
+    values = []
+    v = shift = 0
+    for b in data:
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if b < 0x80:
+            values.append(v)
+            v = shift = 0
+    assert len(values) == count
+    return values
+
+
+def unzigzag(v):
+    return (v >> 1) ^ -(v & 1)
+
+
+def decode(data, encoding, rows):
+    if encoding == 3:
+        return list(data)
+    values = read_varints(data, rows)
+    if encoding == 2:
+        return [unzigzag(v) for v in values]
+    if encoding == 1:
+        prev = 0
+        out = []
+        for v in values:
+            prev = (prev + unzigzag(v)) & 0xffffffffffffffff
+            out.append(prev)
+        return out
+    return values
+
+
+def read_header(f):
+    if f.read(8) != b"PTSPAN01":
+        raise ValueError("not a pt_flame span file")
+    (ncols,) = struct.unpack("<I", f.read(4))
+    columns = []
+    for _ in range(ncols):
+        (length,) = struct.unpack("<B", f.read(1))
+        name = f.read(length).decode()
+        (encoding,) = struct.unpack("<B", f.read(1))
+        columns.append((name, encoding))
+    return columns
+
+
+def read_chunks(f):
+    """Yield ("BLCK", rows) with the file at the block's columns, which the
+    caller reads or skips, or ("DICT", symbols)."""
+    while True:
+        tag = f.read(4)
+        if tag == b"BLCK":
+            (rows,) = struct.unpack("<I", f.read(4))
+            yield tag, rows
+        elif tag == b"DICT":
+            (count,) = struct.unpack("<I", f.read(4))
+            symbols = {}
+            for _ in range(count):
+                sid, length = struct.unpack("<II", f.read(8))
+                symbols[sid] = f.read(length).decode(errors="replace")
+            yield tag, symbols
+        else:
+            return
+
+
+def read_spans(f):
+    """Symbols are read in a first pass that seeks over blocks, since a
+    dictionary may follow the blocks using it. Blocks are then decoded one
+    at a time as the returned generator is consumed."""
+    columns = read_header(f)
+    start = f.tell()
+    symbols = {0: ""}
+    for tag, value in read_chunks(f):
+        if tag == b"DICT":
+            symbols.update(value)
+            continue
+        for _ in columns:
+            _, _, size = struct.unpack("<BII", f.read(9))
+            f.seek(size, 1)
+
+    def blocks():
+        f.seek(start)
+        for tag, rows in read_chunks(f):
+            if tag != b"BLCK":
+                continue
+            block = {}
+            for name, encoding in columns:
+                codec, raw_size, size = struct.unpack("<BII", f.read(9))
+                data = f.read(size)
+                if codec == 1:
+                    data = zlib.decompress(data)
+                block[name] = decode(data, encoding, rows)
+            yield rows, block
+
+    return [name for name, _ in columns], blocks(), symbols
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--tid", type=int)
+    parser.add_argument("--symbol")
+    parser.add_argument("--min-duration", type=int, default=0)
+    parser.add_argument("file")
+    args = parser.parse_args()
+
+    pattern = re.compile(args.symbol) if args.symbol else None
+    out = csv.writer(sys.stdout)
+    with open(args.file, "rb") as f:
+        names, blocks, symbols = read_spans(f)
+        out.writerow(names + ["duration", "name"])
+        for rows, block in blocks:
+            for i in range(rows):
+                if args.tid is not None and block["tid"][i] != args.tid:
+                    continue
+                duration = block["end"][i] - block["start"][i]
+                if duration < args.min_duration:
+                    continue
+                name = symbols.get(block["symbol"][i], "")
+                if pattern and not pattern.search(name):
+                    continue
+                out.writerow([block[n][i] for n in names] + [duration, name])
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#include "blockio.hpp"
+
+BlockSource::Options block_options;
+
+static const size_t ALIGN = 4096;
+
+BlockSource::BlockSource(const Options &opts)
+: block(opts.block_size), depth(std::max<size_t>(1, opts.depth)),
+  direct(opts.direct) {
+  if (direct) block = (block + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+BlockSource::~BlockSource() {
+  if (fd >= 0) close(fd);
+}
+
+bool BlockSource::open_file(const std::string &file) {
+  if (direct) {
+    fd = ::open(file.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+      /* e.g. tmpfs */
+      std::cerr << "O_DIRECT not supported for " << file << ", use page cache"
+                << std::endl;
+      direct = false;
+    }
+  }
+  if (fd < 0) fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open " << file << ": " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) return false;
+  file_size = st.st_size;
+  if (!direct) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return true;
+}
+
+bool BlockSource::read_full(char *buf, uint64_t off, size_t len) {
+  /* O_DIRECT reads whole aligned blocks, the last one ends short at EOF.
+     after a short read, e.g. by io_uring, the read restarts at the aligned
+     offset below and rewrites the bytes before off in place */
+  auto end = off + len;
+  while (off < end) {
+    size_t skip = direct ? off % ALIGN : 0;
+    size_t want = end - off + skip;
+    if (direct) want = (want + ALIGN - 1) / ALIGN * ALIGN;
+    auto n = pread(fd, buf - skip, want, off - skip);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= static_cast<ssize_t>(skip)) {
+      std::cerr << "Failed to read trace at " << off << ": "
+                << (n < 0 ? strerror(errno) : "unexpected EOF") << std::endl;
+      return false;
+    }
+    buf += n - skip;
+    off += n - skip;
+  }
+  return true;
+}
+
+char *BlockSource::alloc_block(size_t size) {
+  void *p = nullptr;
+  /* O_DIRECT needs aligned buffers, harmless otherwise. slack for reads
+     rounded up to alignment */
+  if (posix_memalign(&p, ALIGN, size + ALIGN)) throw std::bad_alloc();
+  return static_cast<char *>(p);
+}
+
+/* synchronous pread, kernel readahead is asked to stay depth blocks ahead */
+class PreadSource : public BlockSource {
+  char *buf = nullptr;
+  uint64_t off = 0;
+public:
+  PreadSource(const Options &opts): BlockSource(opts) {}
+  ~PreadSource() { free(buf); }
+  bool open(const std::string &file) {
+    if (!open_file(file)) return false;
+    buf = alloc_block(block);
+    return true;
+  }
+  virtual bool next(const char *&data, size_t &len) {
+    if (off >= file_size) return false;
+    len = std::min<uint64_t>(block, file_size - off);
+    if (!direct && depth > 1)
+      posix_fadvise(fd, off + block, block * (depth - 1), POSIX_FADV_WILLNEED);
+    if (!read_full(buf, off, len)) return false;
+    data = buf;
+    off += len;
+    return true;
+  }
+};
+
+#ifdef HAVE_IO_URING
+/* one ring per file, block k is read into slot k % depth and resubmitted for
+   block k + depth once consumer moves on */
+class UringSource : public BlockSource {
+  struct Slot {
+    char *buf = nullptr;
+    iovec iov;
+    uint64_t off = 0;
+    int res = 0;
+    bool done = true;
+  };
+  std::vector<Slot> slots;
+  uint64_t consumed = 0; /* blocks handed out */
+  int current = -1; /* slot held by consumer */
+
+  int ring_fd = -1;
+  void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+  size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe *cqes;
+
+public:
+  UringSource(const Options &opts): BlockSource(opts) {}
+  bool setup() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring_fd < 0) return false;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) sq_size = cq_size = std::max(sq_size, cq_size);
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) return false;
+    cq_ptr = single ? sq_ptr :
+      mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) return false;
+    sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(
+      mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) return false;
+
+    auto sq = static_cast<char *>(sq_ptr);
+    sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    auto cq = static_cast<char *>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    return true;
+  }
+
+private:
+  int enter(unsigned submit, unsigned wait) {
+    return syscall(__NR_io_uring_enter, ring_fd, submit, wait,
+                   wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  }
+
+  size_t expected(const Slot &s) const {
+    return std::min<uint64_t>(block, file_size - s.off);
+  }
+
+  bool submit(size_t idx, uint64_t off) {
+    auto &s = slots[idx];
+    s.off = off;
+    s.done = false;
+    s.iov = {s.buf, direct ? block : expected(s)};
+    /* single submitter, completions are reaped before slots are reused */
+    unsigned tail = *sq_tail;
+    unsigned i = tail & *sq_mask;
+    auto &sqe = sqes[i];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV; /* READ needs 5.6, READV 5.1 */
+    sqe.fd = fd;
+    sqe.off = off;
+    sqe.addr = reinterpret_cast<uint64_t>(&s.iov);
+    sqe.len = 1;
+    sqe.user_data = idx;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (enter(1, 0) < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return false;
+    }
+    return true;
+  }
+
+  bool reap() {
+    while (1) {
+      unsigned head = *cq_head;
+      if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        auto &cqe = cqes[head & *cq_mask];
+        auto &s = slots[cqe.user_data];
+        s.res = cqe.res;
+        s.done = true;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+      if (enter(0, 1) < 0 && errno != EINTR) return false;
+    }
+  }
+
+public:
+  ~UringSource() {
+    /* in-flight reads must finish before their buffers are released */
+    for (auto &s: slots) while (!s.done && reap());
+    for (auto &s: slots) free(s.buf);
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+  }
+
+  bool open(const std::string &file) {
+    if (!open_file(file)) return false;
+    slots.resize(depth);
+    for (size_t i = 0; i < depth; ++i) {
+      slots[i].buf = alloc_block(block);
+      if (i * block < file_size && !submit(i, i * block)) return false;
+    }
+    return true;
+  }
+
+  virtual bool next(const char *&data, size_t &len) {
+    if (current >= 0) {
+      /* consumer is done with previous block, reuse its slot */
+      auto off = slots[current].off + block * depth;
+      if (off < file_size && !submit(current, off)) return false;
+      current = -1;
+    }
+    uint64_t off = consumed * block;
+    if (off >= file_size) return false;
+    size_t idx = consumed % depth;
+    auto &s = slots[idx];
+    while (!s.done)
+      if (!reap()) return false;
+    if (s.res < 0) {
+      std::cerr << "Failed to read trace at " << off << ": "
+                << strerror(-s.res) << std::endl;
+      return false;
+    }
+    len = expected(s);
+    /* short read before EOF, finish it synchronously */
+    if (static_cast<size_t>(s.res) < len &&
+        !read_full(s.buf + s.res, off + s.res, len - s.res))
+      return false;
+    data = s.buf;
+    current = idx;
+    consumed++;
+    return true;
+  }
+};
+#endif
+
+BlockSource *BlockSource::open(const std::string &file, const Options &opts) {
+#ifdef HAVE_IO_URING
+  if (opts.engine == URING) {
+    auto src = new UringSource(opts);
+    if (src->setup()) {
+      if (src->open(file)) return src;
+      delete src;
+      return nullptr;
+    }
+    delete src;
+    static bool warned = false;
+    if (!warned) {
+      warned = true;
+      std::cerr << "io_uring unavailable (" << strerror(errno)
+                << "), use pread" << std::endl;
+    }
+  }
+#endif
+  auto src = new PreadSource(opts);
+  if (src->open(file)) return src;
+  delete src;
+  return nullptr;
+}
+
+BlockStreambuf::int_type BlockStreambuf::underflow() {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  if (finished) return traits_type::eof();
+  if (!src) src = BlockSource::open(file, block_options);
+  const char *data;
+  size_t len;
+  if (!src || !src->next(data, len)) {
+    /* release buffers and ring as soon as file is drained */
+    finished = true;
+    delete src;
+    src = nullptr;
+    setg(nullptr, nullptr, nullptr);
+    return traits_type::eof();
+  }
+  auto p = const_cast<char *>(data);
+  setg(p, p, p + len);
+  return traits_type::to_int_type(*gptr());
+}
+
+FdStreambuf::int_type FdStreambuf::underflow() {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  ssize_t n;
+  do n = read(fd, &buf[0], buf.size());
+  while (n < 0 && errno == EINTR);
+  if (n <= 0) return traits_type::eof();
+  setg(&buf[0], &buf[0], &buf[0] + n);
+  return traits_type::to_int_type(*gptr());
+}
+
+std::istream *open_trace(const std::string &file) {
+  struct stat st;
+  if (block_options.engine == BlockSource::IFSTREAM ||
+      stat(file.c_str(), &st) || !S_ISREG(st.st_mode))
+    return new std::ifstream(file);
+  return new BlockIstream(file);
+}
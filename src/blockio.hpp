@@ -0,0 +1,84 @@
+#ifndef __BLOCKIO_HEADER__
+#define __BLOCKIO_HEADER__
+
+#include <cstdint>
+#include <istream>
+#include <streambuf>
+#include <string>
+
+/* reads a regular file front to back in large blocks, keeping reads ahead
+   of the consumer so that parsing overlaps with storage */
+class BlockSource {
+public:
+  enum Engine { URING, PREAD, IFSTREAM };
+  struct Options {
+    Engine engine = URING; /* falls back to PREAD if io_uring is unavailable */
+    size_t block_size = 1 << 20;
+    size_t depth = 4; /* blocks in flight per file */
+    bool direct = false; /* O_DIRECT, block size is rounded to 4K */
+  };
+
+protected:
+  int fd = -1;
+  uint64_t file_size = 0;
+  size_t block;
+  size_t depth;
+  bool direct;
+  BlockSource(const Options &);
+  bool open_file(const std::string &);
+  /* blocking read of len bytes at off, for short reads and fallback. with
+     O_DIRECT, buf must sit at off in a block read from an aligned offset */
+  bool read_full(char *, uint64_t off, size_t len);
+  static char *alloc_block(size_t);
+
+public:
+  virtual ~BlockSource();
+  /* next block in file order, valid until the next call. false at EOF */
+  virtual bool next(const char *&, size_t &) = 0;
+  static BlockSource *open(const std::string &, const Options &);
+};
+
+extern BlockSource::Options block_options;
+
+/* adapts BlockSource to istream, the file is opened on first read and
+   closed at EOF so that many queued files hold no buffers */
+class BlockStreambuf : public std::streambuf {
+  std::string file;
+  BlockSource *src = nullptr;
+  bool finished = false;
+protected:
+  virtual int_type underflow();
+public:
+  BlockStreambuf(const std::string &file): file(file) {}
+  virtual ~BlockStreambuf() { delete src; }
+};
+
+class BlockIstream : public std::istream {
+  BlockStreambuf buf;
+public:
+  BlockIstream(const std::string &file): std::istream(nullptr), buf(file) {
+    rdbuf(&buf);
+  }
+};
+
+/* reads a pipe or any other fd, e.g. stdout of perf script child */
+class FdStreambuf : public std::streambuf {
+  int fd;
+  std::string buf;
+protected:
+  virtual int_type underflow();
+public:
+  FdStreambuf(int fd, size_t size = 1 << 20): fd(fd), buf(size, '\0') {}
+};
+
+class FdIstream : public std::istream {
+  FdStreambuf buf;
+public:
+  FdIstream(int fd): std::istream(nullptr), buf(fd) { rdbuf(&buf); }
+};
+
+/* opens trace file with engine in block_options, pipes and other
+   non-seekable files always use ifstream */
+std::istream *open_trace(const std::string &);
+
+#endif
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <iomanip>
+#include <string>
+#include <unordered_set>
+
+#include "callgraph.hpp"
+#include "replay.hpp"
+
+CallGraph::CallGraph(Func *root) {
+  /* skips /global_root/ */
+  for (auto f: root->callee) {
+    total += f->stats.sum_inferred;
+    collapse(nullptr, f);
+  }
+}
+
+void CallGraph::collapse(Func *caller, Func *f) {
+  auto id = f->id();
+  auto &n = nodes[id];
+  bool outermost = on_stack[id] == 0;
+  n.calls += f->stats.invoked;
+  n.inferred += f->stats.inferred;
+  n.exclusive += f->graph_self_time();
+  if (outermost) n.inclusive += f->stats.sum_inferred;
+  if (caller) {
+    auto &e = nodes[caller->id()].callees[id];
+    e.calls += f->stats.invoked;
+    if (outermost) e.inclusive += f->stats.sum_inferred;
+  }
+
+  on_stack[id]++;
+  for (auto c: f->callee)
+    if (f->graph_callee(c)) collapse(f, c);
+  on_stack[id]--;
+}
+
+void CallGraph::callgrind(std::ostream &os) {
+  std::unordered_set<uint32_t> named;
+  auto fn_name = [&](uint32_t id) {
+    std::string ret = '(' + std::to_string(id) + ')';
+    /* name compression, full name only at first occurrence */
+    if (named.insert(id).second) ret += ' ' + symbol_name(id);
+    return ret;
+  };
+
+  os << "# callgrind format\n"
+     << "version: 1\n"
+     << "creator: pt_flame\n"
+     << "positions: line\n"
+     << "events: ns\n"
+     << "summary: " << total << "\n\n";
+
+  /* stable output order */
+  std::map<uint32_t, Node *> sorted;
+  for (auto &[id, n]: nodes) sorted[id] = &n;
+  for (auto &[id, n]: sorted) {
+    os << "fn=" << fn_name(id) << '\n' << "0 " << n->exclusive << '\n';
+    for (auto &[cid, e]: n->callees) {
+      os << "cfn=" << fn_name(cid) << '\n'
+         << "calls=" << e.calls << " 0\n"
+         << "0 " << e.inclusive << '\n';
+    }
+    os << '\n';
+  }
+}
+
+void CallGraph::top(std::ostream &os, size_t limit) {
+  std::vector<std::pair<uint32_t, Node *>> sorted;
+  for (auto &[id, n]: nodes) sorted.emplace_back(id, &n);
+  std::sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) {
+    return a.second->exclusive > b.second->exclusive;
+  });
+  if (sorted.size() > limit) sorted.resize(limit);
+
+  auto percent = [this](Time t) {
+    return total ? 100.0 * t / total : 0.0;
+  };
+  os << std::setw(14) << "self(ns)" << std::setw(8) << "self%"
+     << std::setw(14) << "total(ns)" << std::setw(8) << "total%"
+     << std::setw(12) << "calls" << std::setw(12) << "avg(ns)"
+     << "  symbol" << std::endl;
+  os << std::fixed << std::setprecision(2);
+  for (auto &[id, n]: sorted) {
+    os << std::setw(14) << n->exclusive << std::setw(8)
+       << percent(n->exclusive) << std::setw(14) << n->inclusive
+       << std::setw(8) << percent(n->inclusive) << std::setw(12) << n->calls
+       << std::setw(12) << std::setprecision(0)
+       << (n->calls ? double(n->inclusive) / n->calls : 0.0)
+       << std::setprecision(2) << "  " << symbol_name(id) << std::endl;
+  }
+  os << std::defaultfloat;
+}
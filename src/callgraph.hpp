@@ -0,0 +1,41 @@
+#ifndef __CALLGRAPH_HEADER__
+#define __CALLGRAPH_HEADER__
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "reader.hpp"
+
+struct Func;
+
+/* function level call graph collapsed from merged Func tree, all call paths
+   of a symbol are summed. under recursion only the outermost invocation
+   contributes inclusive time, so inclusive never exceeds total time */
+class CallGraph {
+  struct Edge {
+    size_t calls = 0;
+    Time inclusive = 0;
+  };
+  struct Node {
+    Time inclusive = 0;
+    Time exclusive = 0;
+    size_t calls = 0;
+    size_t inferred = 0;
+    std::map<uint32_t, Edge> callees;
+  };
+  std::unordered_map<uint32_t, Node> nodes; /* by symbol id */
+  std::unordered_map<uint32_t, size_t> on_stack;
+  Time total = 0;
+
+  void collapse(Func *, Func *);
+
+public:
+  CallGraph(Func *);
+  void callgrind(std::ostream &);
+  void top(std::ostream &, size_t);
+};
+
+#endif
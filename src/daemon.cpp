@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "daemon.hpp"
+#include "session_impl.hpp"
+
+static const size_t read_size = 1 << 20;
+/* interned names kept across windows, e.g. of jit code that keeps changing */
+static const size_t max_symbols = 1 << 20;
+
+Daemon::Daemon(const std::string &input, const Options &opts)
+: input(input), opts(opts), session(opts.session) {
+  if (opts.socket != "")
+    server.reset(new UnixServer(opts.socket, [this](const std::string &r) {
+      return query(r);
+    }));
+}
+
+Daemon::~Daemon() {
+  /* no queries in flight while trees are freed */
+  server.reset();
+  for (auto &w: ring) delete w.tree;
+}
+
+void Daemon::replay_line(std::string &line) {
+  Action action;
+  try {
+    if (!TraceReader::parse_line(line, action)) return;
+  } catch (...) {
+    std::cerr << "Error when reading line " << line << std::endl;
+    return;
+  }
+  if (opts.window) {
+    auto next_end = action.ts - action.ts % opts.window + opts.window;
+    if (window_end == 0) window_end = next_end;
+    /* later captures may also start back in time, e.g. another host */
+    if (action.ts >= window_end || next_end < window_end) {
+      close_window(action.ts >= window_end ? window_end : session.last_time());
+      /* no empty windows over gaps between captures */
+      window_end = next_end;
+    }
+  }
+  if (!window_actions) window_begin = action.ts;
+  session.internal().feed(action);
+  window_actions++;
+}
+
+void Daemon::feed(const char *data, size_t len) {
+  auto end = data + len;
+  while (data < end) {
+    auto nl = static_cast<const char *>(memchr(data, '\n', end - data));
+    if (!nl) {
+      partial.append(data, end);
+      break;
+    }
+    partial.append(data, nl);
+    replay_line(partial);
+    partial.clear();
+    data = nl + 1;
+  }
+}
+
+void Daemon::end_segment() {
+  if (!partial.empty()) {
+    replay_line(partial);
+    partial.clear();
+  }
+  /* segments are separate captures, time between them is not replayed */
+  session.restart();
+  if (!opts.window) close_window(session.last_time());
+}
+
+void Daemon::close_window(Time end) {
+  if (!window_actions) return;
+  Window w = {next_seq++, window_begin, end, window_actions, 0,
+              session.internal().take(end)};
+  std::function<size_t(const Func *)> count = [&](const Func *f) {
+    size_t n = 1;
+    for (auto c: f->callee) n += count(c);
+    return n;
+  };
+  w.funcs = count(w.tree);
+  window_actions = 0;
+  session.internal().rotate(max_symbols);
+  std::cerr << "window: " << w.seq << " " << pretty_time(w.begin) << " - "
+            << pretty_time(w.end) << " actions " << w.actions << std::endl;
+
+  std::vector<Func *> expired;
+  {
+    std::lock_guard<std::mutex> lg(lock);
+    ring.push_back(w);
+    while (ring.size() > opts.windows) {
+      expired.push_back(ring.front().tree);
+      ring.pop_front();
+    }
+  }
+  for (auto f: expired) delete f;
+}
+
+bool Daemon::replay_file(const std::string &path) {
+  std::ifstream is(path, std::ios::binary);
+  if (!is) {
+    std::cerr << "Failed to open " << path << std::endl;
+    return false;
+  }
+  std::vector<char> buf(read_size);
+  while (is) {
+    is.read(buf.data(), buf.size());
+    feed(buf.data(), is.gcount());
+  }
+  end_segment();
+  std::cerr << "segment: " << path << std::endl;
+  return true;
+}
+
+void Daemon::watch_dir() {
+  while (!stopping.load()) {
+    std::vector<std::string> names;
+    if (auto dir = opendir(input.c_str())) {
+      while (auto e = readdir(dir)) {
+        std::string name = e->d_name;
+        /* writers rename finished segments into the spool */
+        if (name[0] == '.' || name <= last_file ||
+            (name.size() > 4 && name.substr(name.size() - 4) == ".tmp"))
+          continue;
+        struct stat st;
+        if (stat((input + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+          names.push_back(name);
+      }
+      closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+    for (auto &name: names) {
+      if (stopping.load()) break;
+      auto path = input + "/" + name;
+      if (replay_file(path) && opts.remove) unlink(path.c_str());
+      last_file = name;
+    }
+    if (names.empty()) poll(nullptr, 0, opts.poll_ms);
+  }
+}
+
+void Daemon::watch_fifo() {
+  /* opened for write too, so the fifo never reports end of file between
+     writers. a segment ends when writers are idle for poll_ms */
+  int fd = open(input.c_str(), O_RDWR);
+  if (fd < 0) {
+    std::cerr << "Failed to open " << input << std::endl;
+    return;
+  }
+  std::vector<char> buf(read_size);
+  bool pending = false;
+  while (!stopping.load()) {
+    pollfd pfd = {fd, POLLIN, 0};
+    int r = poll(&pfd, 1, opts.poll_ms);
+    if (r > 0) {
+      auto n = read(fd, buf.data(), buf.size());
+      if (n <= 0) continue;
+      feed(buf.data(), n);
+      pending = true;
+    } else if (r == 0 && pending) {
+      end_segment();
+      pending = false;
+    }
+  }
+  close(fd);
+}
+
+bool Daemon::run() {
+  struct stat st;
+  if (stat(input.c_str(), &st) != 0) {
+    std::cerr << "Failed to stat " << input << std::endl;
+    return false;
+  }
+  if (S_ISDIR(st.st_mode)) watch_dir();
+  else if (S_ISFIFO(st.st_mode)) watch_fifo();
+  else {
+    std::cerr << input << " is neither a directory nor a fifo" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+std::string Daemon::query(const std::string &request) {
+  std::istringstream is(request);
+  std::string cmd, which;
+  is >> cmd >> which;
+  std::ostringstream os;
+  if (cmd == "report") {
+    metrics.report(os);
+    return os.str();
+  }
+
+  std::lock_guard<std::mutex> lg(lock);
+  if (cmd == "" || cmd == "list") {
+    os << "seq begin end actions funcs" << std::endl;
+    for (auto &w: ring)
+      os << w.seq << " " << pretty_time(w.begin) << " " << pretty_time(w.end)
+         << " " << w.actions << " " << w.funcs << std::endl;
+    return os.str();
+  }
+  if (cmd != "folded" && cmd != "tree")
+    return "unknown query " + cmd +
+           ", expect list, folded [seq|last|all], tree [seq|last|all] or report\n";
+  if (ring.empty()) return "no window yet\n";
+
+  Func *tree = nullptr;
+  std::unique_ptr<Func> merged;
+  if (which == "all") {
+    merged.reset(new Func(ring.front().tree->sym, nullptr, 0, 0));
+    for (auto &w: ring) merged->merge_copy(w.tree);
+    tree = merged.get();
+  } else if (which == "" || which == "last") {
+    tree = ring.back().tree;
+  } else {
+    uint64_t seq = 0;
+    try {
+      seq = std::stoull(which);
+    } catch (...) {
+      return "bad window " + which + "\n";
+    }
+    for (auto &w: ring) if (w.seq == seq) tree = w.tree;
+    if (!tree) return "no window " + which + "\n";
+  }
+  if (cmd == "folded") tree->flame_graph(os);
+  else tree->pretty_print(os, "");
+  return os.str();
+}
@@ -0,0 +1,82 @@
+#ifndef __DAEMON_HEADER__
+#define __DAEMON_HEADER__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "metrics.hpp"
+#include "replay.hpp"
+#include "session.hpp"
+
+/* long running replay of trace segments from a spool directory or a FIFO.
+   one session replays all segments, so interned symbols persist, and the
+   aggregate of each window is kept in a ring of the last windows. memory is
+   bounded by the ring, the active stacks, and per window state dropped at
+   each window, see Session::Impl::rotate. Func trees use the process
+   allocator, there is no allocator state of its own to keep. windows are
+   queried over a unix socket */
+class Daemon {
+public:
+  struct Options {
+    Time window = 0; /* ns of trace, 0 for one window per segment */
+    size_t windows = 16;
+    std::string socket;
+    int poll_ms = 200;
+    bool remove = false; /* delete spool files once replayed */
+    ptflame::Session::Options session;
+  };
+
+private:
+  struct Window {
+    uint64_t seq;
+    Time begin, end;
+    uint64_t actions;
+    size_t funcs;
+    Func *tree;
+  };
+
+  std::string input;
+  Options opts;
+  ptflame::Session session;
+  std::unique_ptr<UnixServer> server;
+
+  std::mutex lock; /* ring, taken by server thread for queries */
+  std::deque<Window> ring;
+  uint64_t next_seq = 0;
+
+  Time window_begin = 0;
+  Time window_end = 0; /* next boundary when opts.window is set */
+  uint64_t window_actions = 0;
+  std::string partial; /* unterminated line of current segment */
+  std::string last_file; /* spool files are replayed in name order */
+
+  static inline std::atomic<bool> stopping{false};
+
+  void replay_line(std::string &);
+  void feed(const char *, size_t);
+  void end_segment();
+  void close_window(Time);
+  bool replay_file(const std::string &);
+  void watch_dir();
+  void watch_fifo();
+  std::string query(const std::string &);
+
+public:
+  Daemon(const std::string &input, const Options &);
+  ~Daemon();
+  Daemon(const Daemon &) = delete;
+  Daemon &operator=(const Daemon &) = delete;
+
+  bool ok() const { return !server || server->ok(); }
+  /* replays until request_stop, returns false if input is unusable */
+  bool run();
+  /* async signal safe */
+  static void request_stop() { stopping.store(true); }
+};
+
+#endif
@@ -1,7 +1,12 @@
 #include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstdlib>
+#include <cstring>
 #include <getopt.h>
 #include <fstream>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <vector>
@@ -10,10 +15,141 @@
 #include "reader.hpp"
 #include "replay.hpp"
 #include "perfetto.hpp"
+#include "callgraph.hpp"
+#include "daemon.hpp"
+#include "pprof.hpp"
+#include "metrics.hpp"
+#include "perfscript.hpp"
+#include "sampling.hpp"
+#include "session_impl.hpp"
+#include "symbols.hpp"
+
+static std::vector<std::string> split(const std::string &str, char delim) {
+  std::vector<std::string> ret;
+  size_t pos = 0;
+  size_t pos_end = 0;
+  while (pos < str.size()) {
+    pos_end = str.find(delim, pos);
+    if (pos_end == std::string::npos) pos_end = str.size();
+    ret.push_back(str.substr(pos, pos_end - pos));
+    pos = pos_end + 1;
+  }
+  return ret;
+}
+
+/* words as sh splits them: blanks separate, quotes group and backslash
+   escapes. no expansion. false on an unterminated quote */
+static bool split_args(const std::string &str, std::vector<std::string> &args) {
+  std::string word;
+  bool in_word = false;
+  char quote = 0;
+  for (size_t i = 0; i < str.size(); ++i) {
+    char c = str[i];
+    if (quote) {
+      if (c == quote) quote = 0;
+      else if (quote == '"' && c == '\\' && i + 1 < str.size() &&
+               strchr("\"\\$`", str[i + 1]))
+        word += str[++i];
+      else word += c;
+      continue;
+    }
+    if (c == ' ' || c == '\t' || c == '\n') {
+      if (in_word) args.push_back(word);
+      word.clear();
+      in_word = false;
+      continue;
+    }
+    in_word = true;
+    if (c == '\'' || c == '"') quote = c;
+    else if (c == '\\' && i + 1 < str.size()) word += str[++i];
+    else word += c;
+  }
+  if (in_word) args.push_back(word);
+  return !quote;
+}
+
+/* long only options */
+enum {
+  OPT_TID = 256, OPT_CPU, OPT_FROM, OPT_TO, OPT_INCLUDE, OPT_EXCLUDE,
+  OPT_SLICE, OPT_SLICE_PREFIX, OPT_LATENCY, OPT_LATENCY_OUTPUT,
+  OPT_LATENCY_BINARY, OPT_CALLGRIND, OPT_TOP,
+  OPT_PPROF, OPT_SPANS, OPT_PERFETTO_FORMAT, OPT_PERFETTO_MIN,
+  OPT_PERFETTO_ROTATE_SIZE, OPT_PERFETTO_ROTATE_TIME,
+  OPT_REPORT, OPT_REPORT_SOCKET, OPT_IO_ENGINE, OPT_IO_BLOCK, OPT_IO_DEPTH,
+  OPT_IO_DIRECT, OPT_PIN_READER, OPT_PIN_MAIN, OPT_NUMA,
+  OPT_PERF_DATA, OPT_PERF, OPT_PERF_JOBS, OPT_PERF_SPLIT, OPT_PERF_CPUS,
+  OPT_PERF_ARGS, OPT_REORDER, OPT_REORDER_BUFFER, OPT_LOSS_REPORT,
+  OPT_LOSS_BUCKET, OPT_INFERRED_PCT, OPT_SYMBOLS, OPT_TRACE_MODE,
+  OPT_LOCK_WAIT, OPT_LOCK_WAIT_OUTPUT, OPT_LOCK_WAIT_MIN,
+  OPT_PMP, OPT_PMP_OUTPUT, OPT_PMP_FORMAT, OPT_DAEMON, OPT_DAEMON_SOCKET,
+  OPT_DAEMON_WINDOW, OPT_DAEMON_WINDOWS, OPT_DAEMON_REMOVE, OPT_SAMPLE,
+  OPT_SAMPLE_BY, OPT_SAMPLE_SLICE, OPT_SAMPLE_SEED,
+};
+
+static const struct option long_options[] = {
+  {"tid", required_argument, nullptr, OPT_TID},
+  {"cpu", required_argument, nullptr, OPT_CPU},
+  {"from", required_argument, nullptr, OPT_FROM},
+  {"to", required_argument, nullptr, OPT_TO},
+  {"include", required_argument, nullptr, OPT_INCLUDE},
+  {"exclude", required_argument, nullptr, OPT_EXCLUDE},
+  {"slice", required_argument, nullptr, OPT_SLICE},
+  {"slice-prefix", required_argument, nullptr, OPT_SLICE_PREFIX},
+  {"latency", required_argument, nullptr, OPT_LATENCY},
+  {"latency-output", required_argument, nullptr, OPT_LATENCY_OUTPUT},
+  {"latency-binary", no_argument, nullptr, OPT_LATENCY_BINARY},
+  {"callgrind", required_argument, nullptr, OPT_CALLGRIND},
+  {"top", required_argument, nullptr, OPT_TOP},
+  {"pprof", required_argument, nullptr, OPT_PPROF},
+  {"spans", required_argument, nullptr, OPT_SPANS},
+  {"perfetto-format", required_argument, nullptr, OPT_PERFETTO_FORMAT},
+  {"perfetto-min", required_argument, nullptr, OPT_PERFETTO_MIN},
+  {"perfetto-rotate-size", required_argument, nullptr, OPT_PERFETTO_ROTATE_SIZE},
+  {"perfetto-rotate-time", required_argument, nullptr, OPT_PERFETTO_ROTATE_TIME},
+  {"report", required_argument, nullptr, OPT_REPORT},
+  {"report-socket", required_argument, nullptr, OPT_REPORT_SOCKET},
+  {"io-engine", required_argument, nullptr, OPT_IO_ENGINE},
+  {"io-block", required_argument, nullptr, OPT_IO_BLOCK},
+  {"io-depth", required_argument, nullptr, OPT_IO_DEPTH},
+  {"io-direct", no_argument, nullptr, OPT_IO_DIRECT},
+  {"pin-reader", required_argument, nullptr, OPT_PIN_READER},
+  {"pin-main", required_argument, nullptr, OPT_PIN_MAIN},
+  {"numa", no_argument, nullptr, OPT_NUMA},
+  {"perf-data", required_argument, nullptr, OPT_PERF_DATA},
+  {"perf", required_argument, nullptr, OPT_PERF},
+  {"perf-jobs", required_argument, nullptr, OPT_PERF_JOBS},
+  {"perf-split", required_argument, nullptr, OPT_PERF_SPLIT},
+  {"perf-cpus", required_argument, nullptr, OPT_PERF_CPUS},
+  {"perf-args", required_argument, nullptr, OPT_PERF_ARGS},
+  {"reorder", required_argument, nullptr, OPT_REORDER},
+  {"reorder-buffer", required_argument, nullptr, OPT_REORDER_BUFFER},
+  {"loss-report", required_argument, nullptr, OPT_LOSS_REPORT},
+  {"loss-bucket", required_argument, nullptr, OPT_LOSS_BUCKET},
+  {"inferred-pct", no_argument, nullptr, OPT_INFERRED_PCT},
+  {"symbols", required_argument, nullptr, OPT_SYMBOLS},
+  {"trace-mode", required_argument, nullptr, OPT_TRACE_MODE},
+  {"lock-wait", required_argument, nullptr, OPT_LOCK_WAIT},
+  {"lock-wait-output", required_argument, nullptr, OPT_LOCK_WAIT_OUTPUT},
+  {"lock-wait-min", required_argument, nullptr, OPT_LOCK_WAIT_MIN},
+  {"pmp", required_argument, nullptr, OPT_PMP},
+  {"pmp-output", required_argument, nullptr, OPT_PMP_OUTPUT},
+  {"pmp-format", required_argument, nullptr, OPT_PMP_FORMAT},
+  {"daemon", required_argument, nullptr, OPT_DAEMON},
+  {"daemon-socket", required_argument, nullptr, OPT_DAEMON_SOCKET},
+  {"daemon-window", required_argument, nullptr, OPT_DAEMON_WINDOW},
+  {"daemon-windows", required_argument, nullptr, OPT_DAEMON_WINDOWS},
+  {"daemon-remove", no_argument, nullptr, OPT_DAEMON_REMOVE},
+  {"sample", required_argument, nullptr, OPT_SAMPLE},
+  {"sample-by", required_argument, nullptr, OPT_SAMPLE_BY},
+  {"sample-slice", required_argument, nullptr, OPT_SAMPLE_SLICE},
+  {"sample-seed", required_argument, nullptr, OPT_SAMPLE_SEED},
+  {nullptr, 0, nullptr, 0}
+};
 
 int main(int argc, char *argv[]) {
   /* flamegraph options */
   size_t limit = 0;
+  ptflame::Session::Options session_opts;
   size_t parallel = 0;
   size_t read_step = 10000;
   int cpu = -1;
@@ -29,11 +165,69 @@ int main(int argc, char *argv[]) {
   Time stack_last_ts = 0;
   std::string stack_at_end = "";
   bool stack_only = false;
+  std::string pmp_output = "-";
+  auto pmp_format = ptflame::Session::PMP;
 
   std::string perfetto_file = "";
+  std::string perfetto_format = "ftf";
+  Perfetto::Options perfetto_opts;
+  std::string spans_file = "";
+
+  /* time slice options */
+  Time slice_len = 0;
+  std::string slice_prefix = "slice_";
+  size_t slice_printed = 0;
+  Time slice_end = 0;
+
+  /* latency heatmap options */
+  std::string latency_symbols = "";
+  std::string latency_output = "latency";
+  auto latency_format = Latency::CSV;
+
+  /* lock wait options */
+  std::string lock_wait_specs = "";
+  std::string lock_wait_output = "-";
+  Time lock_wait_min = 1000;
+
+  /* call graph options */
+  std::string callgrind_file = "";
+  size_t top_count = 0;
+  std::string pprof_file = "";
+
+  /* reader filter options */
+  ActionFilter filter;
+  bool use_filter = false;
+  double sample_fraction = 1;
+
+  /* symbol options */
+  SymbolIndex symbols;
+
+  /* perf script options */
+  std::string perf_data = "";
+  std::string perf_bin = "perf";
+  size_t perf_jobs = std::max(1U, std::thread::hardware_concurrency());
+  auto perf_split = PerfScript::TIME;
+  std::vector<int> perf_cpus;
+  std::string perf_args = "--itrace=b --ns -F-event,-period,+addr,-comm,+flags,-dso";
+
+  /* reorder options */
+  Time reorder_horizon = 0;
+  size_t reorder_buffer = 1 << 20;
+
+  /* trace loss options */
+  std::string loss_file = "";
+
+  /* daemon options */
+  std::string daemon_input = "";
+  Daemon::Options daemon_opts;
+
+  /* performance report options */
+  std::string report_file = "";
+  std::string report_socket = "";
 
   int opt;
-  while ((opt = getopt(argc, argv, "j:l:s:t:c:S:W:C:I:OP:E:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "j:l:s:t:c:S:W:C:I:OP:E:",
+                            long_options, nullptr)) != -1) {
     switch (opt) {
     case 'l': limit = std::stol(optarg); break;
     case 'j':
@@ -46,18 +240,7 @@ int main(int argc, char *argv[]) {
         std::cerr << "No cpu specified, use -c before -t\n";
         exit(EXIT_FAILURE);
       }
-      {
-        std::string tr_str = optarg;
-        size_t tr_pos = 0;
-        size_t tr_pos_end = 0;
-        while (tr_pos < tr_str.size()) {
-          tr_pos_end = tr_str.find(',', tr_pos);
-          if (tr_pos_end == std::string::npos)
-            tr_pos_end = tr_str.size();
-          cpu_map[cpu].push_back(tr_str.substr(tr_pos, tr_pos_end - tr_pos));
-          tr_pos = tr_pos_end + 1;
-        }
-      }
+      for (auto &tr: split(optarg, ',')) cpu_map[cpu].push_back(tr);
       break;
     case 'S': stack_print = true; stack_prefix = optarg; break;
     case 'W': stack_warmup = std::stol(optarg); break;
@@ -65,7 +248,105 @@ int main(int argc, char *argv[]) {
     case 'C': stack_count = std::stol(optarg); break;
     case 'O': stack_only = true; break;
     case 'E': stack_at_end = std::stol(optarg); break;
+    case OPT_PMP: session_opts.sample_interval = std::stoull(optarg); break;
+    case OPT_PMP_OUTPUT: pmp_output = optarg; break;
+    case OPT_PMP_FORMAT:
+      pmp_format = std::string(optarg) == "folded" ?
+                   ptflame::Session::FOLDED_SAMPLES : ptflame::Session::PMP;
+      break;
     case 'P': perfetto_file = optarg; break;
+    case OPT_TID:
+      for (auto &t: split(optarg, ',')) filter.tids.insert(std::stoul(t));
+      use_filter = true;
+      break;
+    case OPT_CPU:
+      for (auto &c: split(optarg, ',')) filter.cpus.insert(std::stoul(c));
+      use_filter = true;
+      break;
+    case OPT_FROM: filter.begin = parse_time(optarg); use_filter = true; break;
+    case OPT_TO: filter.end = parse_time(optarg); use_filter = true; break;
+    case OPT_INCLUDE: filter.set_include(optarg); use_filter = true; break;
+    case OPT_EXCLUDE: filter.set_exclude(optarg); use_filter = true; break;
+    case OPT_SAMPLE:
+      sample_fraction = std::stod(optarg);
+      if (!(sample_fraction > 0 && sample_fraction < 1)) {
+        std::cerr << "--sample fraction must be within (0, 1)\n";
+        exit(EXIT_FAILURE);
+      }
+      filter.set_sample(sample_fraction);
+      use_filter = true;
+      break;
+    case OPT_SAMPLE_BY:
+      filter.sample_by = std::string(optarg) == "time" ?
+                         ActionFilter::SAMPLE_TIME : ActionFilter::SAMPLE_TID;
+      break;
+    case OPT_SAMPLE_SLICE:
+      filter.sample_slice = std::max(1ULL, std::stoull(optarg));
+      break;
+    case OPT_SAMPLE_SEED: filter.sample_seed = std::stoull(optarg); break;
+    case OPT_SLICE: slice_len = std::stoull(optarg); break;
+    case OPT_SLICE_PREFIX: slice_prefix = optarg; break;
+    case OPT_LATENCY: latency_symbols = optarg; break;
+    case OPT_LATENCY_OUTPUT: latency_output = optarg; break;
+    case OPT_LATENCY_BINARY: latency_format = Latency::BINARY; break;
+    case OPT_LOCK_WAIT: lock_wait_specs = optarg; break;
+    case OPT_LOCK_WAIT_OUTPUT: lock_wait_output = optarg; break;
+    case OPT_LOCK_WAIT_MIN: lock_wait_min = std::stoull(optarg); break;
+    case OPT_CALLGRIND: callgrind_file = optarg; break;
+    case OPT_TOP: top_count = std::stoul(optarg); break;
+    case OPT_PPROF: pprof_file = optarg; break;
+    case OPT_SPANS: spans_file = optarg; break;
+    case OPT_PERFETTO_FORMAT: perfetto_format = optarg; break;
+    case OPT_PERFETTO_MIN: perfetto_opts.min_duration = std::stoull(optarg); break;
+    case OPT_PERFETTO_ROTATE_SIZE:
+      perfetto_opts.rotate_size = std::stoull(optarg) << 20;
+      break;
+    case OPT_PERFETTO_ROTATE_TIME:
+      perfetto_opts.rotate_time = std::stoull(optarg);
+      break;
+    case OPT_REPORT: report_file = optarg; break;
+    case OPT_REPORT_SOCKET: report_socket = optarg; break;
+    case OPT_IO_ENGINE:
+      if (std::string(optarg) == "pread")
+        block_options.engine = BlockSource::PREAD;
+      else if (std::string(optarg) == "ifstream")
+        block_options.engine = BlockSource::IFSTREAM;
+      else block_options.engine = BlockSource::URING;
+      break;
+    case OPT_IO_BLOCK: block_options.block_size = std::stoul(optarg) << 10; break;
+    case OPT_IO_DEPTH: block_options.depth = std::stoul(optarg); break;
+    case OPT_IO_DIRECT: block_options.direct = true; break;
+    case OPT_PIN_READER: placement.reader_cpus = parse_cpu_list(optarg); break;
+    case OPT_PIN_MAIN: placement.main_cpus = parse_cpu_list(optarg); break;
+    case OPT_NUMA: placement.numa = true; break;
+    case OPT_PERF_DATA: perf_data = optarg; break;
+    case OPT_PERF: perf_bin = optarg; break;
+    case OPT_PERF_JOBS: perf_jobs = std::stoul(optarg); break;
+    case OPT_PERF_SPLIT:
+      perf_split = std::string(optarg) == "cpu" ? PerfScript::CPU :
+                                                  PerfScript::TIME;
+      break;
+    case OPT_PERF_CPUS: perf_cpus = parse_cpu_list(optarg); break;
+    case OPT_PERF_ARGS: perf_args = optarg; break;
+    case OPT_REORDER: reorder_horizon = std::stoull(optarg); break;
+    case OPT_REORDER_BUFFER: reorder_buffer = std::stoul(optarg); break;
+    case OPT_LOSS_REPORT: loss_file = optarg; break;
+    case OPT_LOSS_BUCKET: LossStats::bucket = std::stoull(optarg); break;
+    case OPT_INFERRED_PCT: Func::Statistics::show_inferred = true; break;
+    case OPT_SYMBOLS: symbols.load(optarg); break;
+    case OPT_DAEMON: daemon_input = optarg; break;
+    case OPT_DAEMON_SOCKET: daemon_opts.socket = optarg; break;
+    case OPT_DAEMON_WINDOW: daemon_opts.window = std::stoull(optarg); break;
+    case OPT_DAEMON_WINDOWS:
+      daemon_opts.windows = std::max(1UL, std::stoul(optarg));
+      break;
+    case OPT_DAEMON_REMOVE: daemon_opts.remove = true; break;
+    case OPT_TRACE_MODE:
+      if (std::string(optarg) == "user") session_opts.mode = ptflame::Session::USER;
+      else if (std::string(optarg) == "kernel")
+        session_opts.mode = ptflame::Session::KERNEL;
+      else session_opts.mode = ptflame::Session::AUTO;
+      break;
     default:
       std::cerr <<
       "Usage: pt_demo [-l limit] [-j parallel] [-s read_step] "
@@ -85,6 +366,65 @@ int main(int argc, char *argv[]) {
       "       if only CPU-less trace is provided, spawn at least one worker to\n"
       "       parse EACH trace\n"
       "  -s <num> split trace files every num lines to replay, default 10000\n"
+      "     parallel readers adapt it to parse time, and size -j chunks of one\n"
+      "     file from file size and parse rate\n"
+      "  --trace-mode <auto|user|kernel> user skips kernel trace mitigations,\n"
+      "     auto replays as user until the first kernel address, default auto\n"
+      "\n  Trace I/O Options: \n"
+      "  --io-engine <uring|pread|ifstream> how -t and non-parallel traces are\n"
+      "     read, uring keeps io-depth reads in flight per file and falls back\n"
+      "     to pread with readahead if unavailable, default uring\n"
+      "  --io-block <KB> read size, default 1024\n"
+      "  --io-depth <num> blocks in flight per file, default 4\n"
+      "  --io-direct bypass page cache with O_DIRECT\n"
+      "\n  Thread Placement Options: \n"
+      "  --pin-reader <cpulist> pin parallel reader workers, one per cpu in\n"
+      "     list round robin, e.g. 0-7,16-23\n"
+      "  --pin-main <cpulist> pin main thread, which merges and replays\n"
+      "  --numa keep all workers of a reader (-j stream or file) on one node,\n"
+      "     readers are spread over nodes, main thread defaults to node 0.\n"
+      "     buffers are allocated by the pinned thread and stay node local\n"
+      "\n  Perf Script Options: \n"
+      "  --perf-data <file> decode perf.data with perf-jobs perf script children\n"
+      "     and read their output directly, trace files are ignored\n"
+      "  --perf <bin> perf binary, or any program taking perf script arguments,\n"
+      "     default perf\n"
+      "  --perf-jobs <num> perf script children, default number of cpus\n"
+      "  --perf-split <time|cpu> give each child a --time percent slice, or a\n"
+      "     --cpu subset of perf-cpus. default time, later slices are parsed\n"
+      "     ahead into up to 512MB, cpu children are merged as they run\n"
+      "  --perf-cpus <cpulist> cpus recorded in perf.data, default cpus of this\n"
+      "     machine\n"
+      "  --perf-args <args> perf script arguments, split and quoted as by sh,\n"
+      "     default --itrace=b --ns -F-event,-period,+addr,-comm,+flags,-dso\n"
+      "\n  Reorder Options: \n"
+      "  --reorder <t> sort each input within a horizon of t ns before merging,\n"
+      "     for inputs that are only roughly ordered by time, e.g. perf.data\n"
+      "     split at arbitrary points. late actions are counted and reported\n"
+      "  --reorder-buffer <num> max buffered actions per input, default 1048576\n"
+      "\n  Symbol Options: \n"
+      "  --symbols <pid|file.map|elf[@base]> resolve [unknown] frames with\n"
+      "     /tmp/perf-<pid>.map, a perf map file, or function symbols of an ELF\n"
+      "     file loaded at hex base, for shared objects and PIE. repeatable\n"
+      "\n  Filter Options: \n"
+      "  --tid <tid[,tid[...]]> replay these threads only\n"
+      "  --cpu <cpu[,cpu[...]]> replay lines recorded on these CPUs only\n"
+      "     sched lines are kept if either thread is replayed, on any CPU\n"
+      "  --from <ts> --to <ts> replay lines within time range, SEC.NSEC or NSEC\n"
+      "  --include <regex> keep lines with from or to symbol matching regex\n"
+      "  --exclude <regex> drop lines with both from and to symbol matching regex\n"
+      "     dropped lines break call stacks through them, --exclude is safe only\n"
+      "     if matched functions call no unmatched ones\n"
+      "\n  Sampled Replay Options: \n"
+      "  --sample <fraction> replay a deterministic fraction of threads or time\n"
+      "     slices, 0 < fraction < 1. other lines are skipped before symbols\n"
+      "     are parsed. flame graph is scaled by 1/fraction and frames get\n"
+      "     err:<pct>%, the 95% confidence half width of their self time.\n"
+      "     --slice is ignored\n"
+      "  --sample-by <tid|time> sample threads by tid hash, or time slices,\n"
+      "     default tid. time suits few threads, tid keeps call stacks whole\n"
+      "  --sample-slice <t> time slice length, default 1000000 ns\n"
+      "  --sample-seed <num> picks another subset, default 0\n"
       "\n  Print Stack Options: \n"
       "  -S <prefix> print stacks to files named prefix_<seq#>, OVERWRITE\n"
       "     existing files. do NOT print if not set\n"
@@ -93,13 +433,102 @@ int main(int argc, char *argv[]) {
       "  -C <num> print num number of stack, default 1\n"
       "  -E <name> print one stack to file named name at the end of replay\n"
       "  -O output stack only\n"
+      "  --pmp <t> sample stacks of all threads every t ns of trace and count\n"
+      "     identical stacks, pt-pmp style, e.g. 10000\n"
+      "  --pmp-output <name|-> sampled stacks file, default - for stderr\n"
+      "  --pmp-format <pmp|folded> pmp lists count and frames leaf first, most\n"
+      "     frequent first, folded is for flamegraph.pl. default pmp\n"
+      "\n  Time Slice Options: \n"
+      "  --slice <t> write a flame graph for every t ns of trace to files named\n"
+      "     prefix<seq#>, OVERWRITE existing files. invocations are counted in\n"
+      "     the slice where they return, time of open invocations is split at\n"
+      "     slice boundaries. output on stdout is the same as without slices\n"
+      "  --slice-prefix <prefix> slice file prefix, default slice_\n"
+      "\n  Latency Heatmap Options: \n"
+      "  --latency <regex> record start and duration of every call to symbols\n"
+      "     matching regex, write heatmap to prefix.svg and samples to prefix.csv\n"
+      "  --latency-output <prefix> latency output prefix, default latency\n"
+      "  --latency-binary write samples to prefix.bin instead of prefix.csv\n"
+      "\n  Lock Wait Options: \n"
+      "  --lock-wait <wait[:acquire:release][,...]> record every call to wait\n"
+      "     as a blocking interval and acquire return to release call as a\n"
+      "     critical section, e.g. pthread_mutex_lock:pthread_mutex_lock:\n"
+      "     pthread_mutex_unlock,ut_delay. waits are matched to critical\n"
+      "     sections of other threads by time overlap, and call sites are\n"
+      "     ranked by wait time with waiter and holder stacks\n"
+      "  --lock-wait-output <name|-> report file, default - for stderr\n"
+      "  --lock-wait-min <t> ignore waits shorter than t ns, default 1000\n"
+      "\n  Call Graph Options: \n"
+      "  --callgrind <name> write function level call graph in callgrind format\n"
+      "     for KCachegrind/QCachegrind\n"
+      "  --top <num> print num functions with most self time to stderr\n"
+      "  --pprof <name> write gzipped pprof profile with sample types wall_ns,\n"
+      "     calls, inferred_calls, and oncpu_ns if trace stops or switches are\n"
+      "     recorded\n"
+      "\n  Trace Loss Options: \n"
+      "  --loss-report <name|-> write replay mismatches by instruction, symbol\n"
+      "     on top of stack, tid and time, and share of wall time that is\n"
+      "     inferred, - for stderr\n"
+      "  --loss-bucket <t> mismatches over time are counted every t ns,\n"
+      "     default 10000000\n"
+      "  --inferred-pct append inf:<pct>% of inferred time to flame graph frames\n"
       "\n  Perfetto Options: \n"
       "  -P <name> output ftf (fuschia trace format) for use with Perfetto\n"
-      "     don't output if not set\n";
+      "     don't output if not set\n"
+      "  --perfetto-format <ftf|proto> -P output format, proto is perfetto native\n"
+      "     TrackEvent protobuf, which is smaller and loads faster, default ftf\n"
+      "  --perfetto-min <t> leave out calls shorter than t ns, their time is\n"
+      "     shown in caller\n"
+      "  --perfetto-rotate-size <MB> --perfetto-rotate-time <t> switch to a new\n"
+      "     file named name.<seq#> every MB megabytes or every t ns of trace.\n"
+      "     calls open at a switch end in the old file and begin in the new one\n"
+      "\n  Span Export Options: \n"
+      "  --spans <name> write every call as a span (tid, cpu, depth, symbol,\n"
+      "     start, end, inferred flags, id, parent id) to block compressed\n"
+      "     columnar file, read with pt_spans.py\n"
+      "\n  Daemon Options: \n"
+      "  --daemon <dir|fifo> keep running and replay trace segments from a spool\n"
+      "     directory, in name order, or from a fifo, where a segment ends when\n"
+      "     writers are idle for 200 ms. files ending in .tmp are skipped, so\n"
+      "     write there and rename. trace files and output options are ignored\n"
+      "  --daemon-socket <path> serve queries on unix socket path, one line per\n"
+      "     connection: list, folded [seq|last|all], tree [seq|last|all], report\n"
+      "  --daemon-window <t> aggregate every t ns of trace into a window,\n"
+      "     default 0 for one window per segment\n"
+      "  --daemon-windows <num> keep last num windows, default 16\n"
+      "  --daemon-remove delete spool files once replayed\n"
+      "\n  Performance Report Options: \n"
+      "  --report <name|-> write pipeline counters, wait times and stage timers\n"
+      "     as json at exit, - for stderr\n"
+      "  --report-socket <path> serve the same json, live, to every connection\n"
+      "     on unix socket path, e.g. socat - UNIX-CONNECT:path\n";
       exit(EXIT_FAILURE);
     }
   }
 
+  if (use_filter) action_filter = &filter;
+  SampleEstimate *estimate = nullptr;
+  if (sample_fraction < 1) {
+    estimate = new SampleEstimate(sample_fraction);
+    if (slice_len) std::cerr << "--slice is ignored with --sample" << std::endl;
+    slice_len = 0;
+  }
+  if (symbols.size()) symbol_index = &symbols;
+  /* before readers start, so main thread allocations are local too */
+  placement.pin_main();
+  metrics.extra = [](std::ostream &os) { placement.report(os); };
+
+  if (daemon_input != "") {
+    daemon_opts.session = session_opts;
+    metrics.register_worker("main");
+    Daemon daemon(daemon_input, daemon_opts);
+    if (!daemon.ok())
+      std::cerr << "Failed to listen on " << daemon_opts.socket << std::endl;
+    signal(SIGINT, [](int) { Daemon::request_stop(); });
+    signal(SIGTERM, [](int) { Daemon::request_stop(); });
+    return daemon.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   size_t streams = 0;
   if (cpu_map.size() > 1) {
     /* if -t trace is provided, ignore CPU-less trace */
@@ -112,19 +541,39 @@ int main(int argc, char *argv[]) {
     streams = cpu_map[-1].size();
   }
 
+  /* stdin counts as one stream */
+  streams = std::max(1UL, streams);
   size_t real_parallel = std::max(1UL, parallel / streams);
   if (parallel && real_parallel * streams > parallel)
     std::cerr << "Will spawn " << real_parallel * streams << " workers, more then"
               << " specifed number " << parallel;
 
   std::vector<GetAction *> trs;
+  PerfScript *perf_script = nullptr;
 
-  if (parallel) {
+  if (perf_data != "") {
+    if (perf_cpus.empty())
+      for (int c = 0; c < sysconf(_SC_NPROCESSORS_CONF); ++c)
+        perf_cpus.push_back(c);
+    std::vector<std::string> args;
+    if (!split_args(perf_args, args)) {
+      std::cerr << "unterminated quote in --perf-args" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    perf_script = new PerfScript(perf_bin, perf_data, args, perf_split,
+                                 perf_jobs, perf_cpus);
+    if (!perf_script->ok()) exit(EXIT_FAILURE);
+    /* time slices follow each other, cpu subsets are merged by time */
+    if (perf_split == PerfScript::TIME)
+      trs.push_back(new StreamReader(perf_script->streams(), read_step));
+    else for (auto is: perf_script->streams())
+      trs.push_back(new StreamReader(is, read_step));
+  } else if (parallel) {
     if (cpu_map.size() == 1) {
       /* CPU-less traces */
       if (cpu_map[-1].empty()) trs.push_back(new StreamReader(&std::cin, read_step));
       else for (auto &f : cpu_map[-1])
-        trs.push_back(new ParallelReader(f, real_parallel, read_step * 200));
+        trs.push_back(new ParallelReader(f, real_parallel));
     } else {
       /* ordered -t traces */
       for (auto &[num, fs]: cpu_map) {
@@ -144,33 +593,93 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  std::atomic<bool> stop_thread;
-  std::atomic<bool> status_print;
+  /* non-parallel readers parse on main thread */
+  if (!parallel) metrics.register_worker("main");
+  UnixServer *server = nullptr;
+  if (report_socket != "") {
+    server = new UnixServer(report_socket, [](const std::string &) {
+      std::ostringstream os;
+      metrics.report(os);
+      return os.str();
+    });
+    if (!server->ok())
+      std::cerr << "Failed to listen on " << report_socket << std::endl;
+  }
+
+  std::atomic<bool> stop_thread{false};
+  std::atomic<bool> status_print{false};
+  std::mutex status_lock;
+  std::condition_variable status_cv;
   auto status_thread = [&]() {
-    while (!stop_thread.load()) {
-      std::this_thread::sleep_for(std::chrono::seconds(5));
+    std::unique_lock<std::mutex> ul(status_lock);
+    /* woken on stop, so exit is not delayed by the interval */
+    while (!status_cv.wait_for(ul, std::chrono::seconds(5),
+                               [&]() { return stop_thread.load(); }))
       status_print.store(true);
-    }
   };
   std::thread status(status_thread);
 
-  MergeWrapper mw(trs);
+  std::vector<GetAction *> inputs = trs;
+  if (reorder_horizon)
+    for (auto &in: inputs)
+      in = new ReorderWrapper(in, reorder_horizon, reorder_buffer);
+  /* ends before its inputs are deleted */
+  std::optional<MergeWrapper> mw(std::in_place, inputs);
 
   size_t counter = 0;
   Action action;
-  Replay rp;
+  ptflame::Session session(session_opts);
+  auto &replay = session.internal();
 
   if (perfetto_file != "") {
-    perfetto = new Perfetto(perfetto_file);
-    perfetto->emit_magic();
+    if (perfetto_format == "proto")
+      perfetto = new PerfettoProto(perfetto_file, 1, perfetto_opts);
+    else perfetto = new PerfettoFtf(perfetto_file, 1, perfetto_opts);
   }
 
+  if (latency_symbols != "") latency = new Latency(latency_symbols);
+  if (lock_wait_specs != "")
+    lock_waits = new LockWaits(lock_wait_specs, lock_wait_min);
+  if (spans_file != "") spans = new SpanWriter(spans_file);
+
+  /* emit aggregate since previous slice, the total is not changed */
+  auto emit_slice = [&](Time ts) {
+    auto name = slice_prefix + std::to_string(slice_printed++);
+    std::ofstream of(name);
+    session.cut(ts, of);
+    std::cerr << "slice: " << name << " end " << pretty_time(ts) << std::endl;
+  };
+
   Time last_ts;
+  uint64_t sample_unit = UINT64_MAX;
+  /* replay ends with session.stop */
+  std::optional<ScopedTimer> replay_timer(std::in_place, Metrics::REPLAY);
   do {
-    action = mw.next_action_by_block();
+    action = mw->next_action_by_block();
     if (action.inst == Action::END) break;
+    /* sampled time slices are units of the estimate, time between slices
+       that are not adjacent is not replayed */
+    if (estimate && filter.sample_by == ActionFilter::SAMPLE_TIME) {
+      auto unit = action.ts / filter.sample_slice;
+      if (sample_unit != UINT64_MAX && unit != sample_unit) {
+        if (unit == sample_unit + 1) {
+          estimate->add_unit(replay.take(unit * filter.sample_slice));
+        } else {
+          session.restart();
+          estimate->add_unit(replay.take(last_ts));
+        }
+      }
+      sample_unit = unit;
+    }
     last_ts = action.ts;
-    rp.replay(action);
+
+    if (slice_len) {
+      if (slice_end == 0) slice_end = action.ts + slice_len;
+      for (; action.ts >= slice_end; slice_end += slice_len)
+        emit_slice(slice_end);
+    }
+
+    replay.feed(action);
 
     /* pt_pstack */
     if (stack_print) {
@@ -180,7 +689,7 @@ int main(int argc, char *argv[]) {
                  (stack_printed && action.ts - stack_last_ts > stack_interval)) {
           auto name = stack_prefix + std::to_string(stack_printed++);
           std::ofstream of(name);
-          rp.snapshot(of, action.ts);
+          session.stacks(of, action.ts);
           std::cerr << "stack: " << name << std::endl;
           stack_last_ts = action.ts;
         }
@@ -195,23 +704,102 @@ int main(int argc, char *argv[]) {
   } while (++counter < limit || limit == 0);
 
   std::cerr << "counter:" << counter << " ts " << pretty_time(action.ts) << std::endl;
-  stop_thread.store(true);
+  {
+    std::lock_guard<std::mutex> lg(status_lock);
+    stop_thread.store(true);
+  }
+  status_cv.notify_one();
 
   if (stack_at_end != "") {
     std::ofstream of(stack_at_end);
-    rp.snapshot(of, last_ts);
+    session.stacks(of, last_ts);
   }
 
-  rp.cleanup();
+  session.stop();
+  replay_timer.reset();
 
+  if (spans) {
+    delete spans;
+    spans = nullptr;
+  }
+
+  if (latency) {
+    ScopedTimer st(Metrics::OUTPUT);
+    latency->write(latency_output, latency_format);
+    std::cerr << "latency: " << latency_output << ".svg" << std::endl;
+  }
+
+  if (lock_waits) {
+    ScopedTimer st(Metrics::OUTPUT);
+    if (lock_wait_output == "-") lock_waits->report(std::cerr);
+    else {
+      std::ofstream of(lock_wait_output);
+      lock_waits->report(of);
+    }
+  }
+
+  if (session_opts.sample_interval) {
+    ScopedTimer st(Metrics::OUTPUT);
+    if (pmp_output == "-") session.stack_samples(std::cerr, pmp_format);
+    else {
+      std::ofstream of(pmp_output);
+      session.stack_samples(of, pmp_format);
+    }
+  }
+
+  if (slice_len && slice_end) emit_slice(last_ts);
+
+  Func *root = nullptr;
   if (!(stack_print && stack_only)) {
-    auto root = rp.destructive_merge_all();
+    ScopedTimer st(Metrics::MERGE);
+    if (estimate) {
+      if (filter.sample_by == ActionFilter::SAMPLE_TIME)
+        estimate->add_unit(replay.take(session.last_time()));
+      else for (auto t: replay.take_threads()) estimate->add_unit(t);
+      root = estimate->finish();
+      estimate->summary(std::cerr);
+    } else root = replay.finish();
+    /* e.g. empty trace or perf script failed */
+    if (!root) std::cerr << "Nothing replayed" << std::endl;
+  }
+
+  if (root) {
+    ScopedTimer st(Metrics::OUTPUT);
+    if (callgrind_file != "" || top_count) {
+      CallGraph cg(root);
+      if (callgrind_file != "") {
+        std::ofstream of(callgrind_file);
+        cg.callgrind(of);
+      }
+      if (top_count) cg.top(std::cerr, top_count);
+    }
+    if (pprof_file != "" && !Pprof(root).write(pprof_file))
+      std::cerr << "Failed to write pprof profile " << pprof_file << std::endl;
     root->flame_graph(std::cout);
   }
+  if (loss_file == "-") session.loss_report(std::cerr);
+  else if (loss_file != "") {
+    std::ofstream of(loss_file);
+    session.loss_report(of);
+  }
 
+  mw.reset();
+  if (reorder_horizon) for (auto in: inputs) delete in;
   for (auto tr: trs) delete tr;
+  bool perf_failed = perf_script && !perf_script->finish();
+  if (perf_script) delete perf_script;
   if (perfetto) delete perfetto;
+  if (latency) delete latency;
+  if (lock_waits) delete lock_waits;
+  if (estimate) delete estimate;
   status.join();
+
+  if (report_file == "-") metrics.report(std::cerr);
+  else if (report_file != "") {
+    std::ofstream of(report_file);
+    metrics.report(of);
+  }
+  if (server) delete server;
   std::cerr << "done" << std::endl;
-  return 0;
+  return perf_failed ? EXIT_FAILURE : 0;
 }
@@ -0,0 +1,29 @@
+#ifndef __INSTANCE_HEADER__
+#define __INSTANCE_HEADER__
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+/* process wide unique, never 0. thread_local caches are keyed by it rather
+   than by this, which a later object may reuse */
+inline uint64_t new_instance_id() {
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* one T per thread for each owning object, e.g. a shard that the owner
+   registers and later reads. make() runs on first use by a thread and returns
+   the registered T, the owner keeps it */
+template <class T>
+class InstanceLocal {
+  const uint64_t instance = new_instance_id();
+public:
+  template <class Make> T &get(Make make) {
+    thread_local std::pair<uint64_t, T *> local = {0, nullptr};
+    if (local.first != instance) local = {instance, make()};
+    return *local.second;
+  }
+};
+
+#endif
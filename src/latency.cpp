@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "latency.hpp"
+#include "replay.hpp"
+
+Latency *latency = nullptr;
+
+static const size_t heatmap_columns = 200;
+static const size_t buckets_per_octave = 4;
+
+Latency::Shard &Latency::local_shard() {
+  return local.get([this]() {
+    std::lock_guard<std::mutex> lg(lock);
+    shards.push_back(new Shard);
+    return shards.back();
+  });
+}
+
+bool Latency::matches(Shard &s, uint32_t id) {
+  if (id >= s.match.size()) s.match.resize(id + 1, -1);
+  if (s.match[id] < 0)
+    s.match[id] = std::regex_search(symbol_name(id), pattern);
+  return s.match[id];
+}
+
+void Latency::record(Func *f, Time end, bool inferred) {
+  auto &s = local_shard();
+  auto id = f->id();
+  if (!matches(s, id)) return;
+  s.start.push_back(f->start);
+  s.duration.push_back(end - f->start);
+  s.sym.push_back(id);
+  s.inferred.push_back(inferred);
+}
+
+Latency::Shard Latency::merge_shards() {
+  Shard all;
+  std::lock_guard<std::mutex> lg(lock);
+  for (auto s: shards) {
+    all.start.insert(all.start.end(), s->start.begin(), s->start.end());
+    all.duration.insert(all.duration.end(), s->duration.begin(),
+                        s->duration.end());
+    all.sym.insert(all.sym.end(), s->sym.begin(), s->sym.end());
+    all.inferred.insert(all.inferred.end(), s->inferred.begin(),
+                        s->inferred.end());
+  }
+  /* order by start time */
+  std::vector<size_t> order(all.start.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return all.start[a] < all.start[b];
+  });
+  Shard sorted;
+  for (auto i: order) {
+    sorted.start.push_back(all.start[i]);
+    sorted.duration.push_back(all.duration[i]);
+    sorted.sym.push_back(all.sym[i]);
+    sorted.inferred.push_back(all.inferred[i]);
+  }
+  return sorted;
+}
+
+void Latency::write_csv(std::ostream &os, Shard &s) {
+  os << "start,duration,inferred,symbol" << std::endl;
+  for (size_t i = 0; i < s.start.size(); ++i)
+    os << s.start[i] << ',' << s.duration[i] << ',' << int(s.inferred[i])
+       << ',' << symbol_name(s.sym[i]) << '\n';
+}
+
+/* layout: "PTLAT001", u64 rows, columns start[u64], duration[u64], sym[u32],
+   inferred[u8], then u32 symbol count and (u32 id, u32 length, name) pairs */
+void Latency::write_binary(std::ostream &os, Shard &s) {
+  auto put = [&os](const void *p, size_t size) {
+    os.write(reinterpret_cast<const char *>(p), size);
+  };
+  os.write("PTLAT001", 8);
+  uint64_t rows = s.start.size();
+  put(&rows, 8);
+  put(s.start.data(), rows * sizeof(Time));
+  put(s.duration.data(), rows * sizeof(Time));
+  put(s.sym.data(), rows * sizeof(uint32_t));
+  put(s.inferred.data(), rows);
+
+  std::vector<uint32_t> ids(s.sym);
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  uint32_t count = ids.size();
+  put(&count, 4);
+  for (auto id: ids) {
+    auto &name = symbol_name(id);
+    uint32_t len = name.size();
+    put(&id, 4);
+    put(&len, 4);
+    os.write(name.c_str(), len);
+  }
+}
+
+static std::string short_time(double t) {
+  std::ostringstream str;
+  str << std::setprecision(3);
+  if (t < 1e3) str << t << "ns";
+  else if (t < 1e6) str << t / 1e3 << "us";
+  else if (t < 1e9) str << t / 1e6 << "ms";
+  else str << t / 1e9 << "s";
+  return str.str();
+}
+
+void Latency::write_svg(std::ostream &os, Shard &s) {
+  /* heatmap of non inferred samples, x is start time, y is log2 latency */
+  const int width = 1200, height = 600, left = 80, bottom = 40, top = 30;
+  const int plot_w = width - left - 20, plot_h = height - top - bottom;
+
+  Time t_min = UINT64_MAX, t_max = 0, d_min = UINT64_MAX, d_max = 0;
+  size_t n = 0;
+  for (size_t i = 0; i < s.start.size(); ++i) {
+    if (s.inferred[i]) continue;
+    n++;
+    t_min = std::min(t_min, s.start[i]);
+    t_max = std::max(t_max, s.start[i]);
+    d_min = std::min(d_min, std::max<Time>(s.duration[i], 1));
+    d_max = std::max(d_max, std::max<Time>(s.duration[i], 1));
+  }
+
+  os << "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+     << "<svg version=\"1.1\" width=\"" << width << "\" height=\"" << height
+     << "\" xmlns=\"http://www.w3.org/2000/svg\" font-family=\"Verdana\" "
+     << "font-size=\"12\">\n"
+     << "<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n"
+     << "<text x=\"" << width / 2 << "\" y=\"20\" text-anchor=\"middle\" "
+     << "font-size=\"16\">Latency Heatmap (" << n << " calls)</text>\n";
+  if (n == 0) {
+    os << "</svg>\n";
+    return;
+  }
+
+  auto bucket = [](Time d) {
+    return static_cast<int>(std::floor(std::log2(double(d)) *
+                                       buckets_per_octave));
+  };
+  int b_min = bucket(d_min), b_max = bucket(d_max);
+  size_t rows = b_max - b_min + 1;
+  Time span = std::max<Time>(t_max - t_min, 1);
+  std::vector<size_t> cells(heatmap_columns * rows, 0);
+  size_t cell_max = 0;
+  for (size_t i = 0; i < s.start.size(); ++i) {
+    if (s.inferred[i]) continue;
+    size_t col = (s.start[i] - t_min) * (heatmap_columns - 1) / span;
+    size_t row = bucket(std::max<Time>(s.duration[i], 1)) - b_min;
+    cell_max = std::max(cell_max, ++cells[col * rows + row]);
+  }
+
+  double cw = double(plot_w) / heatmap_columns, ch = double(plot_h) / rows;
+  for (size_t col = 0; col < heatmap_columns; ++col) {
+    for (size_t row = 0; row < rows; ++row) {
+      auto c = cells[col * rows + row];
+      if (!c) continue;
+      /* log scale color, light yellow to dark red */
+      double v = std::log(double(c) + 1) / std::log(double(cell_max) + 1);
+      int g = 230 - int(200 * v), b = 150 - int(150 * v);
+      os << "<rect x=\"" << left + col * cw << "\" y=\""
+         << top + plot_h - (row + 1) * ch << "\" width=\"" << cw
+         << "\" height=\"" << ch << "\" fill=\"rgb(240," << g << ',' << b
+         << ")\"><title>" << c << "</title></rect>\n";
+    }
+  }
+
+  /* axes, latency ticks at every octave, time ticks at every tenth */
+  os << "<line x1=\"" << left << "\" y1=\"" << top + plot_h << "\" x2=\""
+     << left + plot_w << "\" y2=\"" << top + plot_h << "\" stroke=\"black\"/>\n"
+     << "<line x1=\"" << left << "\" y1=\"" << top << "\" x2=\"" << left
+     << "\" y2=\"" << top + plot_h << "\" stroke=\"black\"/>\n";
+  for (int b = b_min; b <= b_max; ++b) {
+    if (b % buckets_per_octave) continue;
+    os << "<text x=\"" << left - 5 << "\" y=\""
+       << top + plot_h - (b - b_min) * ch << "\" text-anchor=\"end\">"
+       << short_time(std::pow(2.0, double(b) / buckets_per_octave))
+       << "</text>\n";
+  }
+  for (int i = 0; i <= 10; ++i) {
+    os << "<text x=\"" << left + plot_w * i / 10 << "\" y=\""
+       << top + plot_h + 20 << "\" text-anchor=\"middle\">+"
+       << short_time(double(span) * i / 10) << "</text>\n";
+  }
+  os << "</svg>\n";
+}
+
+void Latency::write(const std::string &prefix, Format format) {
+  auto all = merge_shards();
+  std::ofstream svg(prefix + ".svg");
+  write_svg(svg, all);
+  if (format == BINARY) {
+    std::ofstream bin(prefix + ".bin", std::ios::binary);
+    write_binary(bin, all);
+  } else {
+    std::ofstream csv(prefix + ".csv");
+    write_csv(csv, all);
+  }
+}
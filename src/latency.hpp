@@ -0,0 +1,53 @@
+#ifndef __LATENCY_HEADER__
+#define __LATENCY_HEADER__
+
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "instance.hpp"
+#include "reader.hpp"
+
+struct Func;
+
+/* records (start, duration) of every returned invocation of matching symbols,
+   renders a time x latency heatmap and dumps raw samples */
+class Latency {
+  std::regex pattern;
+
+  /* columnar buffer, one per replay thread so recording takes no lock */
+  struct Shard {
+    std::vector<Time> start;
+    std::vector<Time> duration;
+    std::vector<uint32_t> sym;
+    std::vector<uint8_t> inferred;
+    std::vector<int8_t> match; /* by symbol id, -1 for unknown */
+  };
+  std::mutex lock;
+  std::vector<Shard *> shards;
+  InstanceLocal<Shard> local;
+
+  Shard &local_shard();
+  bool matches(Shard &, uint32_t);
+  Shard merge_shards();
+
+  void write_csv(std::ostream &, Shard &);
+  void write_binary(std::ostream &, Shard &);
+  void write_svg(std::ostream &, Shard &);
+
+public:
+  enum Format { CSV, BINARY };
+
+  Latency(const std::string &re) : pattern(re, std::regex::optimize) {}
+  ~Latency() { for (auto s: shards) delete s; }
+  void record(Func *, Time, bool);
+  /* writes prefix.svg and prefix.csv or prefix.bin */
+  void write(const std::string &prefix, Format);
+};
+
+extern Latency *latency;
+
+#endif
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <unordered_map>
+
+#include "lockwait.hpp"
+#include "replay.hpp"
+
+LockWaits *lock_waits = nullptr;
+
+/* frames nearest to the wait, enough to tell call sites apart */
+static const size_t max_stack_depth = 32;
+static const size_t top_holders = 5;
+
+LockWaits::LockWaits(const std::string &str, Time min_wait)
+: min_wait(min_wait) {
+  std::istringstream is(str);
+  std::string spec;
+  while (std::getline(is, spec, ',')) {
+    if (spec.empty()) continue;
+    std::vector<std::string> parts;
+    std::istringstream ps(spec);
+    std::string p;
+    while (std::getline(ps, p, ':')) parts.push_back(p);
+    parts.resize(3);
+    specs.push_back({parts[0], parts[1], parts[2]});
+  }
+}
+
+LockWaits::Shard &LockWaits::local_shard() {
+  return local.get([this]() {
+    std::lock_guard<std::mutex> lg(lock);
+    shards.push_back(new Shard);
+    return shards.back();
+  });
+}
+
+int32_t LockWaits::matches(Shard &s, uint32_t id) {
+  if (id >= s.match.size()) s.match.resize(id + 1, -2);
+  if (s.match[id] != -2) return s.match[id];
+  auto &name = symbol_name(id);
+  std::vector<std::pair<uint32_t, uint8_t>> r;
+  for (uint32_t i = 0; i < specs.size(); ++i) {
+    uint8_t role = 0;
+    if (name == specs[i].wait) role |= WAIT;
+    if (name == specs[i].acquire) role |= ACQUIRE;
+    if (name == specs[i].release) role |= RELEASE;
+    if (role) r.push_back({i, role});
+  }
+  if (r.empty()) return s.match[id] = -1;
+  s.roles.push_back(std::move(r));
+  return s.match[id] = s.roles.size() - 1;
+}
+
+/* callers of f from thread root, f itself excluded. named once per shard,
+   only for waits and acquires that are kept */
+uint64_t LockWaits::caller_stack(Shard &s, Func *f) {
+  if (!f->caller) return 0;
+  auto hash = f->caller->stack_hash();
+  auto it = s.stacks.find(hash);
+  if (it != s.stacks.end()) return hash;
+  std::vector<const std::string *> frames;
+  for (auto c = f->caller; c && frames.size() < max_stack_depth; c = c->caller)
+    frames.push_back(&c->sym.name);
+  std::string stack;
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    if (!stack.empty()) stack += ';';
+    stack += **it;
+  }
+  s.stacks.emplace(hash, std::move(stack));
+  return hash;
+}
+
+void LockWaits::record(Func *f, Time end) {
+  auto &s = local_shard();
+  auto m = matches(s, f->id());
+  if (m < 0) return;
+  for (auto &[spec, role]: s.roles[m]) {
+    if ((role & WAIT) && end - f->start >= min_wait)
+      s.waits.push_back({f->start, end, f->tid, spec, caller_stack(s, f)});
+    auto &open = s.open[{f->tid, spec}];
+    if (role & RELEASE && !open.empty()) {
+      s.sections.push_back({open.back().start, f->start, f->tid, spec,
+                            open.back().stack});
+      open.pop_back();
+    }
+    /* unmatched acquires, e.g. trylock, are dropped when too deep */
+    if (role & ACQUIRE) {
+      if (open.size() >= 64) open.erase(open.begin());
+      open.push_back({end, caller_stack(s, f)});
+    }
+  }
+}
+
+void LockWaits::report(std::ostream &os, size_t top_n) {
+  std::vector<Interval> waits, sections;
+  /* stacks named in several shards are the same string */
+  std::unordered_map<uint64_t, const std::string *> stacks;
+  std::lock_guard<std::mutex> lg(lock);
+  for (auto s: shards) {
+    waits.insert(waits.end(), s->waits.begin(), s->waits.end());
+    sections.insert(sections.end(), s->sections.begin(), s->sections.end());
+    for (auto &[hash, stack]: s->stacks) stacks.emplace(hash, &stack);
+  }
+  auto stack_name = [&](uint64_t hash) -> const std::string & {
+    static const std::string none;
+    auto it = stacks.find(hash);
+    return it == stacks.end() ? none : *it->second;
+  };
+  std::sort(sections.begin(), sections.end(),
+            [](const Interval &a, const Interval &b) {
+    return a.spec != b.spec ? a.spec < b.spec : a.start < b.start;
+  });
+  std::vector<Time> longest(specs.size(), 0);
+  for (auto &c: sections)
+    longest[c.spec] = std::max(longest[c.spec], c.end - c.start);
+
+  struct Site {
+    uint32_t spec;
+    uint64_t stack;
+    uint64_t count = 0;
+    Time total = 0, max = 0, overlapped = 0;
+    std::unordered_map<uint64_t, Time> holders; /* by stack */
+  };
+  std::map<std::pair<uint32_t, uint64_t>, Site> sites;
+  Time total = 0;
+  for (auto &w: waits) {
+    auto &site = sites[{w.spec, w.stack}];
+    site.spec = w.spec;
+    site.stack = w.stack;
+    site.count++;
+    site.total += w.end - w.start;
+    site.max = std::max(site.max, w.end - w.start);
+    total += w.end - w.start;
+
+    /* sections of other threads overlapping this wait */
+    Interval lo = {w.start > longest[w.spec] ? w.start - longest[w.spec] : 0,
+                   0, 0, w.spec, 0};
+    auto it = std::lower_bound(sections.begin(), sections.end(), lo,
+                               [](const Interval &a, const Interval &b) {
+      return a.spec != b.spec ? a.spec < b.spec : a.start < b.start;
+    });
+    std::vector<std::pair<Time, Time>> overlaps;
+    for (; it != sections.end() && it->spec == w.spec && it->start < w.end;
+         ++it) {
+      if (it->tid == w.tid || it->end <= w.start) continue;
+      auto b = std::max(w.start, it->start), e = std::min(w.end, it->end);
+      overlaps.push_back({b, e});
+      site.holders[it->stack] += e - b;
+    }
+    /* union, holders may overlap each other */
+    std::sort(overlaps.begin(), overlaps.end());
+    Time covered = 0, reach = 0;
+    for (auto &[b, e]: overlaps) {
+      b = std::max(b, reach);
+      if (e > b) covered += e - b;
+      reach = std::max(reach, e);
+    }
+    site.overlapped += covered;
+  }
+
+  std::vector<Site *> ranked;
+  for (auto &[key, site]: sites) ranked.push_back(&site);
+  std::sort(ranked.begin(), ranked.end(), [](const Site *a, const Site *b) {
+    return a->total > b->total;
+  });
+  if (ranked.size() > top_n) ranked.resize(top_n);
+
+  auto ms = [](Time ns) { return ns / 1000000.0; };
+  os << std::fixed << std::setprecision(3);
+  os << "lock waits: " << waits.size() << " waits, " << ms(total)
+     << " ms, " << sections.size() << " critical sections, " << sites.size()
+     << " call sites" << std::endl;
+  size_t rank = 0;
+  for (auto site: ranked) {
+    auto &spec = specs[site->spec];
+    os << std::endl << "#" << ++rank << " " << spec.wait << ": "
+       << ms(site->total) << " ms in " << site->count << " waits, max "
+       << ms(site->max) << " ms";
+    if (!spec.acquire.empty())
+      os << ", " << std::setprecision(1)
+         << (site->total ? site->overlapped * 100.0 / site->total : 0)
+         << "% overlapped by holders" << std::setprecision(3);
+    os << std::endl << "  waiter: " << stack_name(site->stack) << std::endl;
+    std::vector<std::pair<uint64_t, Time>> holders(site->holders.begin(),
+                                                   site->holders.end());
+    std::sort(holders.begin(), holders.end(),
+              [](const auto &a, const auto &b) {
+      return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    if (holders.size() > top_holders) holders.resize(top_holders);
+    for (auto &[stack, t]: holders)
+      os << "  holder " << ms(t) << " ms: " << stack_name(stack) << std::endl;
+  }
+  os << std::defaultfloat;
+}
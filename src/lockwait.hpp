@@ -0,0 +1,69 @@
+#ifndef __LOCKWAIT_HEADER__
+#define __LOCKWAIT_HEADER__
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "instance.hpp"
+#include "reader.hpp"
+
+struct Func;
+
+/* lock contention from replayed calls. a spec is wait[:acquire:release],
+   every call to wait is a blocking interval of its thread, and the time
+   between return of acquire and call of release is a critical section.
+   traces carry no lock address, so waits are correlated with critical
+   sections of the same spec on other threads by time overlap */
+class LockWaits {
+  struct Spec {
+    std::string wait, acquire, release;
+  };
+  enum Role : uint8_t { WAIT = 1, ACQUIRE = 2, RELEASE = 4 };
+  struct Interval {
+    Time start, end;
+    size_t tid;
+    uint32_t spec;
+    uint64_t stack; /* hash of caller stack, see Shard::stacks */
+  };
+  struct Open {
+    Time start;
+    uint64_t stack;
+  };
+
+  std::vector<Spec> specs;
+  Time min_wait;
+
+  /* one per replay thread so recording takes no lock */
+  struct Shard {
+    std::vector<int32_t> match; /* by symbol id, -2 unchecked, -1 none */
+    std::vector<std::vector<std::pair<uint32_t, uint8_t>>> roles; /* spec, role */
+    std::vector<Interval> waits;
+    std::vector<Interval> sections;
+    std::map<std::pair<size_t, uint32_t>, std::vector<Open>> open; /* tid, spec */
+    std::unordered_map<uint64_t, std::string> stacks; /* caller stacks by hash */
+  };
+  std::mutex lock;
+  std::vector<Shard *> shards;
+  InstanceLocal<Shard> local;
+
+  Shard &local_shard();
+  int32_t matches(Shard &, uint32_t);
+  uint64_t caller_stack(Shard &, Func *);
+
+public:
+  /* specs separated by comma, waits shorter than min_wait are dropped */
+  LockWaits(const std::string &specs, Time min_wait);
+  ~LockWaits() { for (auto s: shards) delete s; }
+  void record(Func *, Time);
+  /* contended call sites ranked by wait time, with holder stacks */
+  void report(std::ostream &, size_t top_n = 20);
+};
+
+extern LockWaits *lock_waits;
+
+#endif
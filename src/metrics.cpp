@@ -0,0 +1,137 @@
+#include <cstring>
+#include <iomanip>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+
+Metrics metrics;
+
+static thread_local Metrics::Worker *worker = nullptr;
+
+static const char *wait_names[] = {
+  "stream_consumer", "stream_worker", "parallel_consumer", "parallel_worker",
+  "replay_worker", "span_writer", "perfetto_writer"
+};
+static const char *timer_names[] = {"replay", "merge", "output"};
+
+Metrics::Worker &Metrics::register_worker(const std::string &stage) {
+  std::lock_guard<std::mutex> lg(lock);
+  size_t id = 0;
+  for (auto &w: workers) id += w.stage == stage;
+  workers.emplace_back(stage, id);
+  worker = &workers.back();
+  return *worker;
+}
+
+Metrics::Worker *Metrics::local_worker() { return worker; }
+
+thread_local Metrics::FuncCount Metrics::func_count;
+
+void Metrics::FuncCount::publish() {
+  metrics.funcs_allocated.fetch_add(allocated, std::memory_order_relaxed);
+  metrics.funcs_freed.fetch_add(freed, std::memory_order_relaxed);
+  allocated = freed = 0;
+}
+
+void Metrics::report(std::ostream &os) {
+  /* other threads publish when they exit */
+  func_count.publish();
+  double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+  auto rate = [elapsed](uint64_t n) {
+    return elapsed > 0 ? static_cast<uint64_t>(n / elapsed) : 0;
+  };
+  auto ms = [](uint64_t ns) { return ns / 1000000.0; };
+
+  os << std::fixed << std::setprecision(3);
+  os << "{\n  \"elapsed_s\": " << elapsed << ",\n  \"workers\": [";
+  {
+    std::lock_guard<std::mutex> lg(lock);
+    bool first = true;
+    for (auto &w: workers) {
+      os << (first ? "" : ",") << "\n    {\"stage\": \"" << w.stage
+         << "\", \"id\": " << w.id << ", \"lines\": " << w.lines.load()
+         << ", \"bytes\": " << w.bytes.load()
+         << ", \"actions\": " << w.actions.load() << "}";
+      first = false;
+    }
+  }
+  os << "\n  ],\n  \"waits\": {";
+  for (int i = 0; i < WAIT_END; ++i) {
+    os << (i ? "," : "") << "\n    \"" << wait_names[i]
+       << "\": {\"count\": " << wait_count[i].load()
+       << ", \"ms\": " << ms(wait_ns[i].load()) << "}";
+  }
+  os << "\n  },\n  \"timers_ms\": {";
+  for (int i = 0; i < TIMER_END; ++i)
+    os << (i ? ", " : "") << "\"" << timer_names[i]
+       << "\": " << ms(timer_ns[i].load());
+  os << "},\n"
+     << "  \"merge\": {\"actions\": " << merged.load()
+     << ", \"actions_per_s\": " << rate(merged.load()) << "},\n"
+     << "  \"replay\": {\"actions\": " << replayed.load()
+     << ", \"actions_per_s\": " << rate(replayed.load())
+     << ", \"mismatches\": " << mismatches.load() << "},\n"
+     << "  \"reorder\": {\"late\": " << late.load() << "},\n"
+     << "  \"func\": {\"allocated\": " << funcs_allocated.load()
+     << ", \"freed\": " << funcs_freed.load() << "},\n"
+     << "  \"archive\": {\"trees\": " << archived.load() << "}";
+  if (extra) extra(os);
+  os << "\n}" << std::endl;
+  os << std::defaultfloat;
+}
+
+UnixServer::UnixServer(
+    const std::string &path,
+    std::function<std::string(const std::string &)> handler)
+: path(path), handler(handler) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) return;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return;
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, 8) < 0) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  thr = std::thread(&UnixServer::serve, this);
+  pthread_setname_np(thr.native_handle(), "Server");
+}
+
+UnixServer::~UnixServer() {
+  if (fd < 0) return;
+  stop = true;
+  thr.join();
+  close(fd);
+  unlink(path.c_str());
+}
+
+void UnixServer::serve() {
+  while (!stop) {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 200) <= 0) continue;
+    int conn = accept(fd, nullptr, nullptr);
+    if (conn < 0) continue;
+    /* read request line, short timeout so silent clients get default */
+    std::string request;
+    char c;
+    pollfd cfd = {conn, POLLIN, 0};
+    while (poll(&cfd, 1, 100) > 0 && read(conn, &c, 1) == 1 && c != '\n')
+      request.push_back(c);
+    auto response = handler(request);
+    size_t off = 0;
+    while (off < response.size()) {
+      auto n = write(conn, response.data() + off, response.size() - off);
+      if (n <= 0) break;
+      off += n;
+    }
+    close(conn);
+  }
+}
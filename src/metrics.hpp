@@ -0,0 +1,130 @@
+#ifndef __METRICS_HEADER__
+#define __METRICS_HEADER__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+/* always-on pipeline counters and timers, reported as json */
+class Metrics {
+public:
+  /* one per parsing thread, updated by its owner only */
+  struct alignas(64) Worker {
+    std::string stage;
+    size_t id;
+    std::atomic<uint64_t> lines{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> actions{0};
+    Worker(const std::string &stage, size_t id): stage(stage), id(id) {}
+  };
+
+  /* places where a thread blocks on a condition variable */
+  enum Wait {
+    STREAM_CONSUMER, /* main thread waits StreamReader segment */
+    STREAM_WORKER, /* StreamReader worker waits for room to queue */
+    PARALLEL_CONSUMER, /* main thread waits ParallelReader block */
+    PARALLEL_WORKER, /* ParallelReader worker claims next chunk */
+    REPLAY_WORKER, /* ParallelReplay worker waits for action */
+    SPAN_WRITER, /* replay waits span blocks to be written */
+    PERFETTO_WRITER, /* replay waits perfetto buffers to be written */
+    WAIT_END
+  };
+  enum Timer { REPLAY, MERGE, OUTPUT, TIMER_END };
+
+private:
+  std::mutex lock;
+  std::deque<Worker> workers;
+  std::atomic<uint64_t> wait_ns[WAIT_END] = {};
+  std::atomic<uint64_t> wait_count[WAIT_END] = {};
+  std::atomic<uint64_t> timer_ns[TIMER_END] = {};
+  std::chrono::steady_clock::time_point start_time;
+
+public:
+  /* Func allocations of one thread, published every 4096 and at thread
+     exit, as Replay publishes replayed actions */
+  struct FuncCount {
+    uint64_t allocated = 0, freed = 0;
+    void publish();
+    ~FuncCount() { publish(); }
+  };
+  static thread_local FuncCount func_count;
+  static void func_allocated() {
+    if (++func_count.allocated == 4096) func_count.publish();
+  }
+  static void func_freed() {
+    if (++func_count.freed == 4096) func_count.publish();
+  }
+
+  std::atomic<uint64_t> merged{0}; /* actions out of MergeWrapper */
+  std::atomic<uint64_t> replayed{0}; /* actions through Replay::replay */
+  std::atomic<uint64_t> mismatches{0}; /* History::replay failures */
+  std::atomic<uint64_t> archived{0}; /* trees moved to Replay::archive */
+  std::atomic<uint64_t> late{0}; /* out of ReorderWrapper horizon */
+  std::atomic<uint64_t> funcs_allocated{0}; /* see FuncCount */
+  std::atomic<uint64_t> funcs_freed{0};
+  /* extra json members appended to report, e.g. topology */
+  std::function<void(std::ostream &)> extra;
+
+  Metrics(): start_time(std::chrono::steady_clock::now()) {}
+
+  /* registers calling thread as a parsing worker of stage */
+  Worker &register_worker(const std::string &stage);
+  static Worker *local_worker();
+
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+  void add_wait(Wait w, uint64_t ns) {
+    wait_ns[w].fetch_add(ns, std::memory_order_relaxed);
+    wait_count[w].fetch_add(1, std::memory_order_relaxed);
+  }
+  void add_time(Timer t, uint64_t ns) {
+    timer_ns[t].fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  void report(std::ostream &);
+};
+
+extern Metrics metrics;
+
+/* measures a blocking region, e.g. a condition variable wait */
+class ScopedWait {
+  Metrics::Wait w;
+  uint64_t start;
+public:
+  ScopedWait(Metrics::Wait w): w(w), start(Metrics::now_ns()) {}
+  ~ScopedWait() { metrics.add_wait(w, Metrics::now_ns() - start); }
+};
+
+class ScopedTimer {
+  Metrics::Timer t;
+  uint64_t start;
+public:
+  ScopedTimer(Metrics::Timer t): t(t), start(Metrics::now_ns()) {}
+  ~ScopedTimer() { metrics.add_time(t, Metrics::now_ns() - start); }
+};
+
+/* serves one response per connection on a unix socket in background,
+   request is the first line sent by client */
+class UnixServer {
+  std::string path;
+  int fd = -1;
+  std::atomic<bool> stop{false};
+  std::thread thr;
+  std::function<std::string(const std::string &)> handler;
+  void serve();
+public:
+  UnixServer(const std::string &,
+             std::function<std::string(const std::string &)>);
+  ~UnixServer();
+  bool ok() const { return fd >= 0; }
+};
+
+#endif
@@ -1,107 +1,343 @@
+#include <algorithm>
+#include <stdexcept>
+#include <pthread.h>
+
+#include "metrics.hpp"
 #include "perfetto.hpp"
+#include "reader.hpp"
 
 Perfetto *perfetto = nullptr;
+
+Perfetto::Shard &Perfetto::local_shard() {
+  return local.get([this]() {
+    std::lock_guard<std::mutex> lg(lock);
+    if (shards.size() >= max_shards)
+      throw std::runtime_error("more replay threads than perfetto shards");
+    if (!started) {
+      thr = std::thread(&Perfetto::flush_worker, this);
+      pthread_setname_np(thr.native_handle(), "Perfetto");
+      started = true;
+    }
+    auto s = new_shard(shards.size());
+    s->generation = generation.load();
+    shards.push_back(s);
+    return s;
+  });
+}
+
+void Perfetto::submit(Shard &s) {
+  std::unique_lock<std::mutex> ul(lock);
+  if (full.size() >= max_pending_buffers) {
+    ScopedWait sw(Metrics::PERFETTO_WRITER);
+    full_drained.wait(ul, [this]() { return full.size() < max_pending_buffers; });
+  }
+  full.push({s.index, s.generation, std::move(s.buf)});
+  ul.unlock();
+  full_empty.notify_one();
+  s.buf.clear();
+  s.buf.reserve(buffer_size + 4096);
+}
+
+void Perfetto::rotate(Shard &s, uint64_t ts) {
+  if (opts.rotate_time) {
+    uint64_t zero = 0;
+    first_ts.compare_exchange_strong(zero, ts);
+    auto first = first_ts.load();
+    size_t w = ts > first ? (ts - first) / opts.rotate_time : 0;
+    size_t cur = window.load();
+    while (w > cur && !window.compare_exchange_weak(cur, w)) {}
+    /* only the shard moving window forward switches file */
+    if (w > cur) generation.fetch_add(1);
+    s.next_rotate_ts = first + (w + 1) * opts.rotate_time;
+  }
+
+  auto gen = generation.load();
+  if (s.generation == gen) return;
+  /* open slices end with the old file, so every file is balanced */
+  for (auto &[tid, o]: s.open)
+    for (auto it = o.syms.rbegin(); it != o.syms.rend(); ++it)
+      format_function(s, tid, o.pid, *it, symbol_name(*it), ts, END, 0);
+  /* start over in new file with its own string and thread records */
+  if (!s.buf.empty()) submit(s);
+  s.generation = gen;
+  reset_shard(s);
+  for (auto &[tid, o]: s.open)
+    for (auto sym: o.syms)
+      format_function(s, tid, o.pid, sym, symbol_name(sym), ts, BEGIN, 0);
+}
+
+std::ofstream &Perfetto::file(size_t gen) {
+  auto it = files.find(gen);
+  if (it != files.end()) return *it->second;
+  auto name = file_name;
+  if (opts.rotate_size || opts.rotate_time) name += "." + std::to_string(gen);
+  auto os = new std::ofstream(name, std::ios::binary);
+  std::string header;
+  emit_header(header);
+  os->write(header.data(), header.size());
+  files[gen] = os;
+  opened++;
+  return *os;
+}
+
+void Perfetto::flush_worker() {
+  while (true) {
+    std::unique_lock<std::mutex> ul(lock);
+    full_empty.wait(ul, [this]() { return !full.empty() || stop; });
+    if (full.empty()) return;
+    auto buf = std::move(full.front());
+    full.pop();
+    size_t registered = shards.size();
+    ul.unlock();
+    full_drained.notify_all();
+
+    auto &os = file(buf.generation);
+    os.write(buf.data.data(), buf.data.size());
+    if (opts.rotate_size && buf.generation == generation.load() &&
+        static_cast<size_t>(os.tellp()) >= opts.rotate_size)
+      generation.fetch_add(1);
+
+    /* close files no shard will write to anymore */
+    if (submitted.size() <= buf.shard) submitted.resize(buf.shard + 1, 0);
+    submitted[buf.shard] = buf.generation;
+    size_t oldest = buf.generation;
+    for (size_t i = 0; i < registered; ++i)
+      oldest = std::min(oldest, i < submitted.size() ? submitted[i] : 0);
+    while (!files.empty() && files.begin()->first < oldest) {
+      delete files.begin()->second;
+      files.erase(files.begin());
+    }
+  }
+}
+
+void Perfetto::finish() {
+  if (started) {
+    for (auto s: shards)
+      if (!s->buf.empty()) submit(*s);
+    {
+      std::lock_guard<std::mutex> lg(lock);
+      stop = true;
+    }
+    full_empty.notify_one();
+    thr.join();
+    for (auto s: shards) delete s;
+    shards.clear();
+  }
+  /* always leave a valid file */
+  if (!opened) file(0);
+  for (auto &[gen, os]: files) delete os;
+  files.clear();
+}
+
+std::pair<uint16_t, bool> ClockIndex::get(uint64_t key) {
+  auto it = slots.find(key);
+  if (it != slots.end()) {
+    referenced[it->second - first] = true;
+    return {it->second, false};
+  }
+  size_t slot;
+  if (used < count) slot = used++;
+  else {
+    /* give referenced slots a second chance */
+    while (referenced[hand]) {
+      referenced[hand] = false;
+      hand = (hand + 1) % count;
+    }
+    slot = hand;
+    hand = (hand + 1) % count;
+    slots.erase(keys[slot]);
+  }
+  keys[slot] = key;
+  referenced[slot] = true;
+  uint16_t idx = first + slot;
+  slots.emplace(key, idx);
+  return {idx, true};
+}
+
 /* little endian */
+void PerfettoFtf::put_header(std::string &buf, RecordType t, uint16_t size,
+                             uint64_t payload) {
+  uint64_t header = (t & 0xf) | ((size & 0x0fffUL) << 4) |
+                    ((payload & 0xffffffffffffUL) << 16);
+  buf.append(reinterpret_cast<char *>(&header), 8);
+}
 
-void Perfetto::emit_header(RecordType t, uint16_t size,
-                           uint64_t payload) {
-  uint16_t type_size = (t & 0xf) | ((size & 0x0fff) << 4);
-  os.write(reinterpret_cast<char *>(&type_size), 2);
-  payload = payload & 0xffffffffffffUL;
-  os.write(reinterpret_cast<char *>(&payload), 6);
-}
-
-void Perfetto::emit_event_header(uint16_t size, EventType t,
-                                 size_t arg, size_t tid, size_t pid,
-                                 const std::string &cat,
-                                 const std::string &str) {
-  uint64_t tid_index = register_thread(tid, pid);
-  uint64_t cat_index = register_string(cat);
-  uint64_t str_index = register_string(str);
-  uint64_t payload = (t & 0xf) | ((arg & 0xf) << 4) |
-                     ((tid_index & 0xff) << 8) | (cat_index << 16) |
-                     (str_index << 32);
-  emit_header(RecordType::EVENT, size, payload);
-}
-
-uint16_t Perfetto::register_string(const std::string &str) {
-  /* string already in registry */
-  if (strings.find(str) != strings.end())
-    return strings[str];
-
-  /* replace existing string */
-  if (rstrings.find(string_index) != rstrings.end())
-    strings.erase(rstrings[string_index]);
-  rstrings[string_index] = str;
-  strings[str] = string_index;
-
-  uint64_t payload = (string_index & 0xffff) | ((str.length() & 0xffff) << 16);
+void PerfettoFtf::put_string(std::string &buf, uint16_t idx,
+                             const std::string &str) {
+  uint64_t payload = (idx & 0xffff) | ((str.length() & 0xffff) << 16);
   /* pad string to 8 byte alignment */
   size_t real_len = ((str.length() + 7) / 8);
-  emit_header(RecordType::STRING, real_len + 1, payload);
-  os.write(str.c_str(), str.length());
-  char padding[9] = "\0\0\0\0\0\0\0\0";
-  os.write(padding, real_len * 8 - str.length());
-
-  auto ret = string_index;
-  string_index++;
-  if (string_index == 32768)
-    string_index = 1;
-  return ret;
-}
-
-uint16_t Perfetto::register_thread(size_t tid, size_t pid) {
-  /* thread already in registry */
-  if (threads.find(tid) != threads.end())
-    return threads[tid];
-
-  /* replace existing thread */
-  if (rthreads.find(thread_index) != rthreads.end())
-    threads.erase(rthreads[thread_index]);
-  rthreads[thread_index] = tid;
-  threads[tid] = thread_index;
-
-  uint64_t payload = thread_index & 0xff;
-  /* pad string to 8 byte alignment */
-  emit_header(RecordType::THREAD, 3, payload);
-  os.write(reinterpret_cast<char *>(&pid), 8);
-  os.write(reinterpret_cast<char *>(&tid), 8);
+  put_header(buf, RecordType::STRING, real_len + 1, payload);
+  buf.append(str);
+  buf.append(real_len * 8 - str.length(), '\0');
+}
 
-  auto ret = thread_index;
-  thread_index++;
-  if (thread_index == 255)
-    thread_index = 1;
-  return ret;
+PerfettoFtf::Shard *PerfettoFtf::new_shard(size_t index) {
+  /* indices are partitioned by shard, so records of one shard never refer to
+     strings or threads registered by another shard's buffer. string index is
+     15 bits and thread index is 8 bits, 0 is reserved for inline */
+  size_t str_count = 32767 / max_shards;
+  size_t thr_count = 254 / max_shards;
+  if (str_count < 2 || thr_count < 1)
+    throw std::runtime_error("too many perfetto shards for ftf");
+  uint16_t str_first = 1 + index * str_count;
+  uint16_t thr_first = 1 + index * thr_count;
+  auto s = new FtfShard(str_first, str_count, thr_first, thr_count);
+  s->index = index;
+  put_string(s->buf, s->category, "Function Call");
+  return s;
 }
 
-void Perfetto::emit_magic() {
+void PerfettoFtf::reset_shard(Shard &shard) {
+  auto &s = static_cast<FtfShard &>(shard);
+  s.strings.clear();
+  s.threads.clear();
+  put_string(s.buf, s.category, "Function Call");
+}
+
+void PerfettoFtf::emit_header(std::string &buf) {
   uint64_t magic = 0x0016547846040010UL;
-  os.write(reinterpret_cast<char *>(&magic), 8);
-}
-
-void Perfetto::emit_function(size_t tid, size_t pid, const std::string &name,
-                             uint64_t time, EventType t, uint64_t end) {
-  static const std::string category = "Function Call";
-  size_t size = t == EventType::COMPLETE ? 3 : 2;
-  emit_event_header(size, t, 0, tid, pid, category, name);
-  os.write(reinterpret_cast<char *>(&time), 8);
-  if (t == EventType::COMPLETE) os.write(reinterpret_cast<char *>(&end), 8);
-}
-
-// int main() {
-//   std::ofstream of("p.out", std::ios::out | std::ios::binary);
-//   Perfetto p;
-//   std::string f1 = "f1";
-//   std::string f2 = "f2";
-//   std::string f3 = "f3";
-//   std::string f4 = "f4";
-//   p.emit_magic(of);
-//   p.emit_function(of, 6, 16, f1, 0, Perfetto::EventType::BEGIN);
-//   p.emit_function(of, 1, 2, f1, 1, Perfetto::EventType::BEGIN);
-//   p.emit_function(of, 1, 2, f1, 6, Perfetto::EventType::END);
-//   p.emit_function(of, 1, 2, f2, 4, Perfetto::EventType::BEGIN);
-//   p.emit_function(of, 1, 2, f2, 5, Perfetto::EventType::END);
-//   p.emit_function(of, 6, 16, f1, 2, Perfetto::EventType::END);
-//   p.emit_function(of, 1, 2, f3, 2, Perfetto::EventType::COMPLETE, 5);
-//   p.emit_function(of, 1, 2, f3, 1, Perfetto::EventType::COMPLETE, 7);
-// }
+  buf.append(reinterpret_cast<char *>(&magic), 8);
+}
+
+uint16_t PerfettoFtf::register_thread(FtfShard &s, size_t tid, size_t pid) {
+  auto [idx, fresh] = s.threads.get(tid);
+  if (!fresh) return idx;
+  put_header(s.buf, RecordType::THREAD, 3, idx & 0xff);
+  s.buf.append(reinterpret_cast<char *>(&pid), 8);
+  s.buf.append(reinterpret_cast<char *>(&tid), 8);
+  return idx;
+}
+
+void PerfettoFtf::format_function(Shard &shard, size_t tid, size_t pid,
+                                  uint32_t sym, const std::string &name,
+                                  uint64_t time, EventType t, uint64_t end) {
+  auto &s = static_cast<FtfShard &>(shard);
+  uint64_t tid_index = register_thread(s, tid, pid);
+  auto [str_index, fresh] = s.strings.get(sym);
+  if (fresh) put_string(s.buf, str_index, name);
+
+  uint16_t size = t == EventType::COMPLETE ? 3 : 2;
+  uint64_t payload = (t & 0xf) | ((tid_index & 0xff) << 8) |
+                     (uint64_t(s.category) << 16) |
+                     (uint64_t(str_index) << 32);
+  put_header(s.buf, RecordType::EVENT, size, payload);
+  s.buf.append(reinterpret_cast<char *>(&time), 8);
+  if (t == EventType::COMPLETE) s.buf.append(reinterpret_cast<char *>(&end), 8);
+}
+
+/* see protos/perfetto/trace/trace_packet.proto in perfetto */
+enum PacketField {
+  PACKET = 1, CLOCK_SNAPSHOT = 6, TIMESTAMP = 8, SEQUENCE_ID = 10,
+  TRACK_EVENT = 11, INTERNED_DATA = 12, SEQUENCE_FLAGS = 13,
+  TIMESTAMP_CLOCK_ID = 58, PACKET_DEFAULTS = 59, TRACK_DESCRIPTOR = 60
+};
+enum SequenceFlags { INCREMENTAL_STATE_CLEARED = 1, NEEDS_INCREMENTAL_STATE };
+enum Clock {
+  BOOTTIME = 6,
+  /* sequence scoped: deltas, and time since anchor for events back in time */
+  INCREMENTAL = 64, RELATIVE
+};
+enum TrackEventType { SLICE_BEGIN = 1, SLICE_END };
+
+void PerfettoProto::put_packet(ProtoShard &s, const Sequence &seq) {
+  /* trace processor drops interned data without a sequence id */
+  s.packet.uint(SEQUENCE_ID, seq.id);
+  ProtoWriter frame;
+  frame.message(PACKET, s.packet);
+  s.buf.append(frame.data());
+  s.packet.clear();
+}
+
+PerfettoProto::Shard *PerfettoProto::new_shard(size_t index) {
+  auto s = new ProtoShard;
+  s->index = index;
+  return s;
+}
+
+void PerfettoProto::start_sequence(ProtoShard &s, Sequence &seq, size_t tid,
+                                   size_t pid, uint64_t time) {
+  /* ids are dense per shard and partitioned by shard, 0 is reserved */
+  seq.id = (s.sequences.size() - 1) * max_shards + s.index + 1;
+  ProtoWriter desc, thread;
+  thread.uint(1, pid);
+  thread.uint(2, tid);
+  desc.uint(1, seq.id);
+  desc.message(4, thread);
+  s.packet.message(TRACK_DESCRIPTOR, desc);
+  put_packet(s, seq);
+
+  /* reset incremental state, which every later packet of the sequence needs:
+     an incremental clock for timestamps and a relative one for the few that
+     go back, both anchored to boot time, and the thread track as default */
+  ProtoWriter clock, clocks, defaults, event_defaults;
+  clock.uint(1, INCREMENTAL);
+  clock.uint(2, time);
+  clock.uint(3, 1);
+  clocks.message(1, clock);
+  clock.clear();
+  clock.uint(1, RELATIVE);
+  clock.uint(2, 0);
+  clocks.message(1, clock);
+  clock.clear();
+  clock.uint(1, BOOTTIME);
+  clock.uint(2, time);
+  clocks.message(1, clock);
+  event_defaults.uint(11, seq.id);
+  defaults.uint(TIMESTAMP_CLOCK_ID, INCREMENTAL);
+  defaults.message(TRACK_EVENT, event_defaults);
+
+  s.packet.uint(TIMESTAMP, time);
+  s.packet.uint(TIMESTAMP_CLOCK_ID, BOOTTIME);
+  s.packet.uint(SEQUENCE_FLAGS,
+                INCREMENTAL_STATE_CLEARED | NEEDS_INCREMENTAL_STATE);
+  s.packet.message(CLOCK_SNAPSHOT, clocks);
+  s.packet.message(PACKET_DEFAULTS, defaults);
+  put_packet(s, seq);
+  seq.anchor = seq.last_ts = time;
+}
+
+void PerfettoProto::format_function(Shard &shard, size_t tid, size_t pid,
+                                    uint32_t sym, const std::string &name,
+                                    uint64_t time, EventType t, uint64_t end) {
+  auto &s = static_cast<ProtoShard &>(shard);
+  if (t == EventType::COMPLETE) {
+    format_function(s, tid, pid, sym, name, time, EventType::BEGIN, 0);
+    format_function(s, tid, pid, sym, name, end, EventType::END, 0);
+    return;
+  }
+
+  auto &seq = s.sequences[tid];
+  if (!seq.id) start_sequence(s, seq, tid, pid, time);
+
+  if (time >= seq.last_ts) {
+    s.packet.uint(TIMESTAMP, time - seq.last_ts);
+    seq.last_ts = time;
+  } else if (time >= seq.anchor) {
+    /* inferred starts go back, which the incremental clock can not, so
+       they are on the relative clock and leave the incremental one */
+    s.packet.uint(TIMESTAMP, time - seq.anchor);
+    s.packet.uint(TIMESTAMP_CLOCK_ID, RELATIVE);
+  } else {
+    s.packet.uint(TIMESTAMP, time);
+    s.packet.uint(TIMESTAMP_CLOCK_ID, BOOTTIME);
+  }
+
+  s.event.clear();
+  s.event.uint(9, t == EventType::BEGIN ? SLICE_BEGIN : SLICE_END);
+  if (t == EventType::BEGIN) {
+    s.event.uint(10, sym);
+    if (sym >= seq.names.size()) seq.names.resize(sym + 1024);
+    if (!seq.names[sym]) {
+      ProtoWriter event_name;
+      event_name.uint(1, sym);
+      event_name.bytes(2, name);
+      s.interned.clear();
+      s.interned.message(2, event_name);
+      s.packet.message(INTERNED_DATA, s.interned);
+      seq.names[sym] = true;
+    }
+  }
+  s.packet.message(TRACK_EVENT, s.event);
+  put_packet(s, seq);
+}
@@ -1,39 +1,229 @@
 #ifndef __PERFETTO_HEADER__
 #define __PERFETTO_HEADER__
 
-#include <string>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+#include "instance.hpp"
+#include "proto.hpp"
 
+/* buffered trace writer, each replay thread formats records into its own
+   shard buffer, full buffers are written in order by a background thread.
+   output may be rotated into numbered self-contained files by size or by
+   trace time, calls open at a switch are split between the files, and calls
+   shorter than min_duration are left out */
 class Perfetto {
-  std::unordered_map<std::string, size_t> strings;
-  std::unordered_map<size_t, std::string> rstrings;
-  uint16_t string_index = 1;
-  std::unordered_map<size_t, size_t> threads;
-  std::unordered_map<size_t, size_t> rthreads;
-  uint16_t thread_index = 1;
+public:
+  enum EventType {
+    INSTANT = 0, COUNTER, BEGIN, END, COMPLETE
+  };
+
+  struct Options {
+    uint64_t min_duration = 0; /* ns */
+    size_t rotate_size = 0; /* bytes */
+    uint64_t rotate_time = 0; /* ns of trace time */
+  };
+
+protected:
+  struct Shard {
+    size_t index;
+    size_t generation = 0; /* output file of buf */
+    uint64_t next_rotate_ts = 0;
+    std::string buf;
+    /* symbols of BEGIN without END yet, by tid, so that rotation can end
+       them in the old file and begin them again in the new one */
+    struct Open {
+      size_t pid;
+      std::vector<uint32_t> syms;
+    };
+    std::unordered_map<size_t, Open> open;
+    virtual ~Shard() {}
+  };
+
+  /* index space shared by shards is partitioned in format specific way */
+  size_t max_shards;
+
+  virtual Shard *new_shard(size_t index) = 0;
+  /* forget registered strings and threads, called when switching file */
+  virtual void reset_shard(Shard &) = 0;
+  virtual void emit_header(std::string &) = 0;
+  virtual void format_function(Shard &, size_t, size_t, uint32_t,
+                               const std::string &, uint64_t, EventType,
+                               uint64_t) = 0;
+  void finish(); /* flush everything, call in derived destructor */
+
+private:
+  static const size_t buffer_size = 1 << 20;
+  static const size_t max_pending_buffers = 64;
 
-  std::ofstream os;
+  std::string file_name;
+  Options opts;
+  std::mutex lock;
+  std::vector<Shard *> shards;
+  InstanceLocal<Shard> local;
+  struct Buffer {
+    size_t shard;
+    size_t generation;
+    std::string data;
+  };
+  std::queue<Buffer> full;
+  std::condition_variable full_empty;
+  std::condition_variable full_drained;
+  bool stop = false;
+  bool started = false;
+  std::thread thr;
+
+  /* rotation, only touched by flush thread except generation */
+  std::atomic<size_t> generation{0};
+  std::atomic<size_t> window{0};
+  std::atomic<uint64_t> first_ts{0};
+  std::map<size_t, std::ofstream *> files;
+  size_t opened = 0;
+  std::vector<size_t> submitted; /* generation last written by each shard */
+
+  Shard &local_shard();
+  void submit(Shard &);
+  void rotate(Shard &, uint64_t);
+  void flush_worker();
+  std::ofstream &file(size_t);
+
+  void emit(size_t tid, size_t pid, uint32_t sym, const std::string &name,
+            uint64_t ts, EventType t, uint64_t end = 0) {
+    auto &s = local_shard();
+    /* complete events arrive at their end, in post-order of start */
+    auto now = t == COMPLETE ? end : ts;
+    if (s.generation != generation.load(std::memory_order_relaxed) ||
+        (opts.rotate_time && now >= s.next_rotate_ts))
+      rotate(s, now);
+    format_function(s, tid, pid, sym, name, ts, t, end);
+    if (t == BEGIN) {
+      auto &o = s.open[tid];
+      o.pid = pid;
+      o.syms.push_back(sym);
+    } else if (t == END) {
+      auto &syms = s.open[tid].syms;
+      if (!syms.empty()) syms.pop_back();
+    }
+    if (s.buf.size() >= buffer_size) submit(s);
+  }
 
 public:
+  Perfetto(const std::string &f, size_t max_shards, Options opts):
+    max_shards(max_shards), file_name(f), opts(opts) {}
+  virtual ~Perfetto() {}
+
+  void emit_call(size_t tid, size_t pid, uint32_t sym, const std::string &name,
+                 uint64_t ts) {
+    /* short calls are only known at return, emit complete event there */
+    if (!opts.min_duration) emit(tid, pid, sym, name, ts, BEGIN);
+  }
+  void emit_return(size_t tid, size_t pid, uint32_t sym,
+                   const std::string &name, uint64_t start, uint64_t ts,
+                   bool start_is_inferred) {
+    if (opts.min_duration) {
+      if (ts >= start && ts - start >= opts.min_duration)
+        emit(tid, pid, sym, name, start, COMPLETE, ts);
+    } else if (start_is_inferred) {
+      emit(tid, pid, sym, name, start, COMPLETE, ts);
+    } else emit(tid, pid, sym, name, ts, END);
+  }
+};
+
+/* second chance replacement over a fixed range of indices, approximates LRU
+   so hot symbols and threads are rarely re-registered */
+class ClockIndex {
+  uint16_t first;
+  size_t count;
+  size_t used = 0;
+  size_t hand = 0;
+  std::vector<uint64_t> keys;
+  std::vector<bool> referenced;
+  std::unordered_map<uint64_t, uint16_t> slots;
+
+public:
+  ClockIndex(uint16_t first, size_t count):
+    first(first), count(count), keys(count), referenced(count) {}
+  /* returns index for key and whether it is newly assigned */
+  std::pair<uint16_t, bool> get(uint64_t key);
+  void clear() {
+    used = hand = 0;
+    slots.clear();
+  }
+};
+
+/* fuchsia trace format */
+class PerfettoFtf : public Perfetto {
   enum RecordType {
     STRING = 2, THREAD, EVENT
   };
-  enum EventType {
-    INSTANT = 0, COUNTER, BEGIN, END, COMPLETE
+  struct FtfShard : Shard {
+    uint16_t category;
+    ClockIndex strings;
+    ClockIndex threads;
+    FtfShard(uint16_t str_first, size_t str_count, uint16_t thr_first,
+             size_t thr_count):
+      category(str_first), strings(str_first + 1, str_count - 1),
+      threads(thr_first, thr_count) {}
   };
-private:
-  void emit_header(RecordType, uint16_t, uint64_t);
-  void emit_event_header(uint16_t, EventType, size_t, size_t, size_t,
-                         const std::string &, const std::string &);
 
-  uint16_t register_string(const std::string &);
-  uint16_t register_thread(size_t, size_t);
+  static void put_header(std::string &, RecordType, uint16_t, uint64_t);
+  static void put_string(std::string &, uint16_t, const std::string &);
+  uint16_t register_thread(FtfShard &, size_t, size_t);
+
+protected:
+  Shard *new_shard(size_t) override;
+  void reset_shard(Shard &) override;
+  void emit_header(std::string &) override;
+  void format_function(Shard &, size_t, size_t, uint32_t, const std::string &,
+                       uint64_t, EventType, uint64_t) override;
+
+public:
+  PerfettoFtf(const std::string &f, size_t max_shards = 1,
+              Options opts = Options()):
+    Perfetto(f, max_shards, opts) {}
+  ~PerfettoFtf() { finish(); }
+};
+
+/* perfetto native protobuf trace with TrackEvent, every traced thread is a
+   packet sequence with its own interned names and incremental timestamps */
+class PerfettoProto : public Perfetto {
+  struct Sequence {
+    uint64_t id = 0; /* sequence id and track uuid, small so varints are */
+    uint64_t anchor = 0; /* zero of the relative clock */
+    uint64_t last_ts = 0;
+    std::vector<bool> names; /* interned in this sequence, by symbol id */
+  };
+  struct ProtoShard : Shard {
+    std::unordered_map<size_t, Sequence> sequences; /* by tid */
+    ProtoWriter packet, event, interned;
+  };
+
+  void put_packet(ProtoShard &, const Sequence &);
+  void start_sequence(ProtoShard &, Sequence &, size_t, size_t, uint64_t);
+
+protected:
+  Shard *new_shard(size_t) override;
+  void reset_shard(Shard &s) override {
+    static_cast<ProtoShard &>(s).sequences.clear();
+  }
+  void emit_header(std::string &) override {}
+  void format_function(Shard &, size_t, size_t, uint32_t, const std::string &,
+                       uint64_t, EventType, uint64_t) override;
+
 public:
-  Perfetto(std::string f) : os(f) {}
-  void emit_magic();
-  void emit_function(size_t, size_t, const std::string &, uint64_t, EventType,
-                     uint64_t = 0);
+  PerfettoProto(const std::string &f, size_t max_shards = 1,
+                Options opts = Options()):
+    Perfetto(f, max_shards, opts) {}
+  ~PerfettoProto() { finish(); }
 };
 
 extern Perfetto *perfetto;
@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "blockio.hpp"
+#include "perfscript.hpp"
+
+PerfScript::PerfScript(
+    const std::string &perf, const std::string &data,
+    const std::vector<std::string> &args, Split split, size_t jobs,
+    const std::vector<int> &cpus) {
+  if (split == CPU) jobs = std::min(jobs, cpus.size());
+  jobs = std::max<size_t>(1, jobs);
+  for (size_t i = 0; i < jobs; ++i) {
+    std::vector<std::string> argv = {perf, "script", "-i", data};
+    for (auto &a: args) if (!a.empty()) argv.push_back(a);
+    if (jobs > 1 && split == TIME) {
+      /* i-th slice of 100/jobs percent, perf counts slices from 1 */
+      char slice[64];
+      snprintf(slice, sizeof(slice), "%.6g%%/%zu", 100.0 / jobs, i + 1);
+      argv.insert(argv.end(), {"--time", slice});
+    } else if (jobs > 1 && split == CPU) {
+      std::string list;
+      for (size_t c = i; c < cpus.size(); c += jobs)
+        list += (list.empty() ? "" : ",") + std::to_string(cpus[c]);
+      argv.insert(argv.end(), {"--cpu", list});
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+      std::cerr << "Failed to create pipe: " << strerror(errno) << std::endl;
+      break;
+    }
+    std::cerr << "perf:";
+    for (auto &a: argv) std::cerr << ' ' << a;
+    std::cerr << std::endl;
+
+    std::vector<char *> cargv;
+    for (auto &a: argv) cargv.push_back(const_cast<char *>(a.c_str()));
+    cargv.push_back(nullptr);
+    auto pid = fork();
+    if (pid == 0) {
+      dup2(fds[1], STDOUT_FILENO);
+      execvp(cargv[0], cargv.data());
+      fprintf(stderr, "Failed to run %s: %s\n", cargv[0], strerror(errno));
+      _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+      std::cerr << "Failed to fork: " << strerror(errno) << std::endl;
+      close(fds[0]);
+      break;
+    }
+    children.push_back({pid, fds[0], new FdIstream(fds[0])});
+  }
+}
+
+PerfScript::~PerfScript() { finish(); }
+
+std::vector<std::istream *> PerfScript::streams() {
+  std::vector<std::istream *> ret;
+  for (auto &c: children) ret.push_back(c.is);
+  return ret;
+}
+
+bool PerfScript::finish() {
+  bool ok = true;
+  for (auto &c: children) {
+    if (c.pid <= 0) continue;
+    /* children still writing, e.g. replay stopped by -l, die of SIGPIPE */
+    delete c.is;
+    close(c.fd);
+    int status = 0;
+    while (waitpid(c.pid, &status, 0) < 0 && errno == EINTR);
+    bool sigpipe = WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE;
+    if (!sigpipe && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+      std::cerr << "perf script " << c.pid << " failed, status " << status
+                << std::endl;
+      ok = false;
+    }
+    c.pid = 0;
+  }
+  return ok;
+}
@@ -0,0 +1,37 @@
+#ifndef __PERFSCRIPT_HEADER__
+#define __PERFSCRIPT_HEADER__
+
+#include <istream>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/* decodes perf.data with N stock perf script children, each writes to its
+   own pipe. TIME children get consecutive --time percent slices, streams are
+   read one after another. CPU children get --cpu subsets, streams overlap in
+   time and need to be merged */
+class PerfScript {
+public:
+  enum Split { TIME, CPU };
+
+private:
+  struct Child {
+    pid_t pid;
+    int fd;
+    std::istream *is;
+  };
+  std::vector<Child> children;
+
+public:
+  PerfScript(const std::string &perf, const std::string &data,
+             const std::vector<std::string> &args, Split split, size_t jobs,
+             const std::vector<int> &cpus);
+  ~PerfScript();
+  bool ok() const { return !children.empty(); }
+  std::vector<std::istream *> streams();
+  /* closes pipes and reaps children, false if any failed. streams are
+     invalid afterwards */
+  bool finish();
+};
+
+#endif
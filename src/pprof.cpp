@@ -0,0 +1,133 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "pprof.hpp"
+#include "replay.hpp"
+
+/* see https://github.com/google/pprof/blob/main/proto/profile.proto */
+enum ProfileField {
+  SAMPLE_TYPE = 1, SAMPLE, MAPPING, LOCATION, FUNCTION, STRING_TABLE,
+  TIME_NANOS = 9, PERIOD_TYPE = 11, PERIOD, DEFAULT_SAMPLE_TYPE = 14
+};
+
+uint64_t Pprof::intern(const std::string &str) {
+  auto it = strings.find(str);
+  if (it != strings.end()) return it->second;
+  uint64_t idx = string_table.size();
+  string_table.push_back(str);
+  strings.emplace(str, idx);
+  return idx;
+}
+
+uint64_t Pprof::location(Func *f) {
+  /* one function and one location per symbol, ids are shared */
+  auto id = f->id();
+  auto it = locations.find(id);
+  if (it != locations.end()) return it->second;
+  uint64_t loc_id = locations.size() + 1;
+  locations.emplace(id, loc_id);
+
+  ProtoWriter func;
+  func.uint(1, loc_id);
+  func.uint(2, intern(f->sym.name));
+  func.uint(3, intern(f->sym.name));
+  profile.message(FUNCTION, func);
+
+  ProtoWriter line;
+  line.uint(1, loc_id);
+  ProtoWriter loc;
+  loc.uint(1, loc_id);
+  if (f->sym.base()) loc.uint(3, f->sym.base());
+  loc.message(4, line);
+  profile.message(LOCATION, loc);
+  return loc_id;
+}
+
+bool Pprof::has_off_cpu(Func *f) {
+  if (f->off_cpu()) return true;
+  for (auto c: f->callee)
+    if (has_off_cpu(c)) return true;
+  return false;
+}
+
+void Pprof::sample(Func *f) {
+  if (f->stats.sum_inferred == 0 && f->stats.invoked == 0) return;
+  /* pprof expects leaf first */
+  stack.insert(stack.begin(), location(f));
+  auto self = f->graph_self_time();
+  std::vector<uint64_t> values = {self, f->stats.invoked, f->stats.inferred};
+  if (has_oncpu) values.push_back(f->off_cpu() ? 0 : self);
+
+  ProtoWriter s;
+  s.packed(1, stack);
+  s.packed(2, values);
+  profile.message(SAMPLE, s);
+
+  for (auto c: f->callee)
+    if (f->graph_callee(c)) sample(c);
+  stack.erase(stack.begin());
+}
+
+Pprof::Pprof(Func *root) {
+  intern("");
+  /* on-CPU time is known only if trace stops or switches are recorded */
+  has_oncpu = has_off_cpu(root);
+  std::vector<std::pair<std::string, std::string>> types = {
+    {"wall_ns", "nanoseconds"}, {"calls", "count"}, {"inferred_calls", "count"}
+  };
+  if (has_oncpu) types.push_back({"oncpu_ns", "nanoseconds"});
+  for (auto &[type, unit]: types) {
+    ProtoWriter vt;
+    vt.uint(1, intern(type));
+    vt.uint(2, intern(unit));
+    profile.message(SAMPLE_TYPE, vt);
+  }
+  ProtoWriter period;
+  period.uint(1, intern("wall_ns"));
+  period.uint(2, intern("nanoseconds"));
+  profile.message(PERIOD_TYPE, period);
+  profile.uint(PERIOD, 1);
+  profile.uint(DEFAULT_SAMPLE_TYPE, intern("wall_ns"));
+
+  Time first = UINT64_MAX;
+  /* skips /global_root/ */
+  for (auto f: root->callee) {
+    first = std::min(first, f->first_start);
+    sample(f);
+  }
+  if (first != UINT64_MAX) profile.uint(TIME_NANOS, first);
+  for (auto &str: string_table) profile.bytes(STRING_TABLE, str);
+}
+
+bool Pprof::write(const std::string &file) {
+  auto &data = profile.data();
+  std::ofstream of(file, std::ios::binary);
+#ifdef HAVE_ZLIB
+  /* gzip wrapper: window bits 15 + 16 */
+  z_stream zs = {};
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  std::string out(deflateBound(&zs, data.size()), '\0');
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  zs.avail_out = out.size();
+  auto ret = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  if (ret != Z_STREAM_END) return false;
+  of.write(out.data(), out.size());
+#else
+  /* pprof accepts uncompressed profile as well */
+  std::cerr << "Warning: built without zlib, pprof output is not compressed"
+            << std::endl;
+  of.write(data.data(), data.size());
+#endif
+  return of.good();
+}
@@ -0,0 +1,33 @@
+#ifndef __PPROF_HEADER__
+#define __PPROF_HEADER__
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "proto.hpp"
+
+struct Func;
+
+/* writes merged Func tree as gzipped pprof profile.proto, every tree node
+   becomes one sample carrying its self values */
+class Pprof {
+  ProtoWriter profile;
+  std::unordered_map<std::string, uint64_t> strings;
+  std::vector<std::string> string_table;
+  std::unordered_map<uint32_t, uint64_t> locations; /* by symbol id */
+  std::vector<uint64_t> stack;
+  bool has_oncpu = false;
+
+  uint64_t intern(const std::string &);
+  uint64_t location(Func *);
+  void sample(Func *);
+  static bool has_off_cpu(Func *);
+
+public:
+  Pprof(Func *);
+  bool write(const std::string &);
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __PROTO_HEADER__
+#define __PROTO_HEADER__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* minimal protobuf encoder, only what pprof and perfetto need */
+class ProtoWriter {
+  std::string buf;
+public:
+  void varint(uint64_t v) {
+    while (v >= 0x80) {
+      buf.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    buf.push_back(static_cast<char>(v));
+  }
+  void tag(uint32_t field, uint32_t wire) { varint((field << 3) | wire); }
+  void uint(uint32_t field, uint64_t v) { tag(field, 0); varint(v); }
+  void bytes(uint32_t field, const std::string &str) {
+    tag(field, 2);
+    varint(str.size());
+    buf.append(str);
+  }
+  void message(uint32_t field, const ProtoWriter &m) { bytes(field, m.buf); }
+  void packed(uint32_t field, const std::vector<uint64_t> &vs) {
+    ProtoWriter p;
+    for (auto v: vs) p.varint(v);
+    bytes(field, p.buf);
+  }
+  void clear() { buf.clear(); }
+  const std::string &data() const { return buf; }
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include <atomic>
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <mutex>
@@ -9,8 +11,13 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
+#include "metrics.hpp"
 #include "reader.hpp"
+#include "symbols.hpp"
+
+ActionFilter *action_filter = nullptr;
 
 static const auto NS_IN_SEC = 1000000000UL;
 static Time make_time(uint64_t s, uint64_t ns) { return s * NS_IN_SEC + ns; }
@@ -23,6 +30,79 @@ std::string pretty_time(Time t) {
   return str.str();
 }
 
+Time parse_time(const std::string &str) {
+  auto dot = str.find('.');
+  if (dot == std::string::npos) return std::stoull(str);
+  /* right pad fraction to 9 digits, e.g. 1.5 -> 1s 500000000ns */
+  auto frac = str.substr(dot + 1, 9);
+  frac.append(9 - frac.size(), '0');
+  return make_time(std::stoull(str.substr(0, dot)), std::stoull(frac));
+}
+
+static std::mutex intern_lock;
+static std::unordered_map<std::string, uint32_t> intern_ids;
+static std::deque<std::string> intern_names = {""};
+
+uint32_t intern_symbol(const std::string &name) {
+  std::lock_guard<std::mutex> lg(intern_lock);
+  auto it = intern_ids.find(name);
+  if (it != intern_ids.end()) return it->second;
+  uint32_t id = intern_names.size();
+  intern_names.push_back(name);
+  intern_ids.emplace(name, id);
+  return id;
+}
+
+const std::string &symbol_name(uint32_t id) {
+  std::lock_guard<std::mutex> lg(intern_lock);
+  return intern_names.at(id);
+}
+
+size_t interned_symbols() {
+  std::lock_guard<std::mutex> lg(intern_lock);
+  return intern_names.size();
+}
+
+void reset_interned_symbols() {
+  std::lock_guard<std::mutex> lg(intern_lock);
+  intern_ids.clear();
+  intern_names = {""};
+}
+
+/* parse decimal number at pos without allocating, throw if there is none */
+static uint64_t parse_number(const std::string &str, size_t pos) {
+  char *end;
+  auto begin = str.c_str() + pos;
+  auto ret = std::strtoull(begin, &end, 10);
+  if (end == begin) throw 0;
+  return ret;
+}
+
+bool ActionFilter::accept_symbols(const Action &act) const {
+  /* regex is slow, cache result by address for each reader thread */
+  thread_local std::unordered_map<uint64_t, std::pair<bool, bool>> cache;
+  thread_local uint64_t owner = 0;
+  if (owner != instance) {
+    cache.clear();
+    owner = instance;
+  }
+  auto match = [&](const Symbol &s) -> std::pair<bool, bool> {
+    auto it = cache.find(s.address);
+    if (it != cache.end()) return it->second;
+    std::pair<bool, bool> r = {
+        has_include && std::regex_search(s.name, include),
+        has_exclude && std::regex_search(s.name, exclude)};
+    if (cache.size() > 1000000) cache.clear();
+    cache.emplace(s.address, r);
+    return r;
+  };
+  auto from = match(act.from);
+  auto to = match(act.to);
+  if (has_include && !from.first && !to.first) return false;
+  if (has_exclude && from.second && to.second) return false;
+  return true;
+}
+
 static std::string process_symbol(std::string str) {
 #ifdef DO_SYMBOL_PROCESS
   /* remove trailing $plt, @plt
@@ -67,6 +147,11 @@ static Symbol get_symbol(std::string &str, size_t pos) {
   static std::string unknown_symbol = "[unknown]";
   std::string symbol;
   if (str.substr(pos, unknown_symbol.size()) == unknown_symbol) {
+    /* JIT or stripped code, resolved from perf map or ELF symbols if any */
+    if (symbol_index) {
+      auto hit = symbol_index->lookup(address);
+      if (hit.name) return {*hit.name, address, address - hit.start};
+    }
     return {unknown_symbol, address, 0};
   } else {
     size_t end = str.find("+0x", pos);
@@ -78,6 +163,33 @@ static Symbol get_symbol(std::string &str, size_t pos) {
   }
 };
 
+/* tracepoint payload after the line prefix, with or without event name
+   sched:sched_switch: prev_comm=a prev_pid=1 prev_prio=120 prev_state=S ==>
+     next_comm=b next_pid=2 next_prio=120
+   sched:sched_wakeup: comm=b pid=2 prio=120 target_cpu=001
+   false if line is not a sched event, other sched events are filtered */
+static bool parse_sched(const std::string &line, size_t pos, Action &act) {
+  if (line.compare(pos, 6, "sched:") && line.compare(pos, 10, "prev_comm=") &&
+      line.compare(pos, 5, "comm="))
+    return false;
+  auto field = [&](const std::string &key) {
+    auto p = line.find(key, pos);
+    if (p == std::string::npos) throw 0;
+    return p + key.size();
+  };
+  act.inst = Action::END;
+  if (line.find(" prev_pid=", pos) != std::string::npos) {
+    act.inst = Action::SCHED_SWITCH;
+    act.tid = parse_number(line, field(" prev_pid="));
+    act.preempted = line[field(" prev_state=")] == 'R';
+    act.peer = parse_number(line, field(" next_pid="));
+  } else if (line.find(" target_cpu=", pos) != std::string::npos) {
+    act.inst = Action::SCHED_WAKEUP;
+    act.peer = parse_number(line, field(" pid="));
+  }
+  return true;
+}
+
 const std::vector<std::pair<const std::string, Action::Inst>> TraceReader::str2inst{
     {"call", Action::CALL},
     {"return", Action::RET},
@@ -93,27 +205,52 @@ const std::vector<std::pair<const std::string, Action::Inst>> TraceReader::str2i
 };
 
 Action TraceReader::next_action_for_stream(std::istream &is) {
+  /* counted locally, published once per returned action */
+  struct Count {
+    uint64_t lines = 0, bytes = 0;
+    Metrics::Worker *w = Metrics::local_worker();
+    void line(const std::string &l) { lines++; bytes += l.size() + 1; }
+    Action publish(Action a) {
+      if (!w) return a;
+      w->lines.fetch_add(lines, std::memory_order_relaxed);
+      w->bytes.fetch_add(bytes, std::memory_order_relaxed);
+      if (a.inst != Action::END)
+        w->actions.fetch_add(1, std::memory_order_relaxed);
+      return a;
+    }
+  } count;
   std::string line;
   while (std::getline(is, line)) {
+    count.line(line);
     Action action;
     while (1) {
       try {
-        action = get_action_from_line(line);
+        if (parse_line(line, action)) return count.publish(action);
         break;
       } catch (...) {
         std::cerr << "Error when reading line " << line << std::endl << std::flush;
-        if (!std::getline(is, line)) return Action();
+        if (!std::getline(is, line)) return count.publish(Action());
+        count.line(line);
       }
     }
-    /* filter redundant jmp */
-    if ((action.inst == Action::JMP || action.inst == Action::JCC) &&
-        (action.from.base() == action.to.base() ||
-         action.from.name == action.to.name))
-      continue;
-    if (action.tid == 0) continue;
-    return action;
   }
-  return Action();
+  return count.publish(Action());
+}
+
+bool TraceReader::parse_line(std::string &line, Action &action) {
+  action = get_action_from_line(line);
+  /* filtered by action_filter */
+  if (action.inst == Action::END) return false;
+  /* either thread may be idle */
+  if (action.inst == Action::SCHED_SWITCH ||
+      action.inst == Action::SCHED_WAKEUP)
+    return true;
+  /* filter redundant jmp */
+  if ((action.inst == Action::JMP || action.inst == Action::JCC) &&
+      (action.from.base() == action.to.base() ||
+       action.from.name == action.to.name))
+    return false;
+  return action.tid != 0;
 }
 
 Action TraceReader::get_action_from_line(std::string &line) {
@@ -129,24 +266,32 @@ Action TraceReader::get_action_from_line(std::string &line) {
   /* thread info */
   size_t start = 0;
   size_t end = line.find_first_of('[');
-  act.tid = std::stol(line.substr(start, end - start));
+  act.tid = parse_number(line, start);
 
   start = end + 1;
   end = line.find_first_of(']', start);
-  act.cpu = std::stol(line.substr(start, end - start));
+  act.cpu = parse_number(line, start);
 
   /* fake tid for sched process on each cpu */
   // if (act.tid == 0) act.tid = UINT64_MAX - act.cpu;
 
   start = end + 1;
   end = line.find_first_of('.');
-  size_t ts1 = std::stol(line.substr(start, end - start));
+  size_t ts1 = parse_number(line, start);
   start = end + 1;
   end = line.find_first_of(':');
-  size_t ts2 = std::stol(line.substr(start, end - start));
+  size_t ts2 = parse_number(line, start);
   act.ts = make_time(ts1, ts2);
 
   start = line.find_first_not_of(' ', end + 1);
+  if (parse_sched(line, start, act)) {
+    if (action_filter && !action_filter->accept_sched(act)) return Action();
+    return act;
+  }
+
+  /* cheap prefix is ready, skip the rest of the line if filtered */
+  if (action_filter && !action_filter->accept_prefix(act.tid, act.cpu, act.ts))
+    return Action();
   end = std::string::npos;
   for (auto &[str, inst]: str2inst) {
     if (line.substr(start, str.size()) != str) continue;
@@ -180,24 +325,54 @@ Action TraceReader::get_action_from_line(std::string &line) {
   start = line.find_first_not_of(' ', start + 2);
   act.to = get_symbol(line, start);
 
+  if (action_filter && (action_filter->has_include ||
+                        action_filter->has_exclude) &&
+      !action_filter->accept_symbols(act))
+    return Action();
   return act;
 }
 
+bool StreamReader::has_room(size_t i) {
+  if (stop.load()) return true;
+  if (i == current_stream.load()) return streams[i]->queued.load() < max_queued;
+  return queued.load() < max_queued_ahead;
+}
+
 void StreamReader::worker(size_t idx) {
-  for (auto i = idx; i < streams.size(); i += thrs.size()) {
+  placement.pin_reader(group, idx);
+  metrics.register_worker("stream");
+  /* handoff every 2 to 20 ms of parsing, within 1/16 to 16 times step */
+  size_t lines = step;
+  for (auto i = next_stream++; i < streams.size(); i = next_stream++) {
     auto &s = *streams[i];
     while (!stop.load() && s.is->good()) {
       std::queue<Action> segment;
       size_t counter = 0;
-      while (!stop.load() && s.is->good() && counter++ < step) {
+      size_t bytes = 0;
+      auto start = Metrics::now_ns();
+      while (!stop.load() && s.is->good() && counter++ < lines) {
         auto action = next_action_for_stream(*(s.is));
-        if (action.inst != Action::END) segment.push(action);
+        if (action.inst == Action::END) continue;
+        bytes += sizeof(Action) + action.from.name.capacity() +
+                 action.to.name.capacity();
+        segment.push(std::move(action));
       }
+      auto ns = Metrics::now_ns() - start;
+      if (ns < 2000000 && lines < step * 16) lines *= 2;
+      else if (ns > 20000000 && lines > step / 16 + 1) lines /= 2;
       if (segment.empty()) continue;
 
-      s.lock.lock();
-      s.segments.push(std::move(segment));
-      s.lock.unlock();
+      if (!has_room(i)) {
+        ScopedWait sw(Metrics::STREAM_WORKER);
+        std::unique_lock<std::mutex> ul(room_lock);
+        room.wait(ul, [&]() { return has_room(i); });
+      }
+      s.queued += bytes;
+      queued += bytes;
+      {
+        std::lock_guard<std::mutex> lg(s.lock);
+        s.segments.push({std::move(segment), bytes});
+      }
       s.empty.notify_one();
     }
     s.finished.store(true);
@@ -208,24 +383,31 @@ void StreamReader::worker(size_t idx) {
 Action StreamReader::next_action() {
   while (current_segment.empty() && current_stream < streams.size()) {
     auto &s = *streams[current_stream];
+    std::unique_lock<std::mutex> ul(s.lock, std::defer_lock);
+    /* skip lock if worker is finished  */
     if (!s.finished.load()) {
-      std::unique_lock<std::mutex> ul(s.lock);
+      ul.lock();
+      ScopedWait sw(Metrics::STREAM_CONSUMER);
       s.empty.wait(ul, [&s](){
         return !s.segments.empty() || s.finished.load();
       });
-      if (s.segments.empty()) {
-        current_stream++;
-        continue;
-      }
+    }
+    size_t bytes = 0;
+    if (s.segments.empty()) {
+      current_stream++;
     } else {
-      /* skip lock if worker is finished  */
-      if (s.segments.empty()) {
-        current_stream++;
-        continue;
-      }
+      current_segment = std::move(s.segments.front().first);
+      bytes = s.segments.front().second;
+      s.segments.pop();
+    }
+    if (ul.owns_lock()) ul.unlock();
+    s.queued -= bytes;
+    queued -= bytes;
+    /* workers may wait for room, or for their stream to be consumed */
+    {
+      std::lock_guard<std::mutex> lg(room_lock);
     }
-    current_segment = std::move(s.segments.front());
-    s.segments.pop();
+    room.notify_all();
   }
   if (current_segment.empty()) return Action();
 
@@ -235,56 +417,81 @@ Action StreamReader::next_action() {
   return ret;
 }
 
-ParallelReader::ParallelReader(
-    std::string file_name, size_t workers, size_t seek_step)
-: file_name(file_name), workers(workers) {
-  for (size_t i = 0; i < workers; ++i) {
-    jqs.push_back(new JobQueue());
-    jqs[i]->thr = std::thread(&ParallelReader::worker, this, jqs[i]);
-    pthread_setname_np(jqs[i]->thr.native_handle(), "Reader");
+ParallelReader::ParallelReader(std::string file_name, size_t workers)
+: file_name(file_name), workers(std::max<size_t>(1, workers)),
+  claim_file(file_name) {
+  claim_file.seekg(0, claim_file.end);
+  file_size = std::max<long>(0, claim_file.tellg());
+  for (size_t i = 0; i < this->workers; ++i) {
+    thrs.push_back(std::thread(&ParallelReader::worker, this, i));
+    pthread_setname_np(thrs.back().native_handle(), "Reader");
   }
+}
 
-  std::ifstream file(file_name);
-  bool reach_end = false;
-  long pos = 0;
-  while (!reach_end) {
-    /* seek forward by seek step, then align pos to line break */
-    file.seekg(seek_step, file.cur);
-    std::string line;
-    std::getline(file, line);
-    if (!file.good()) {
-      file.clear();
-      file.seekg(0, file.end);
-      reach_end = true;
-    }
-    auto next_pos = file.tellg();
-    auto &jq = *jqs[total_segment++ % workers];
-    jq.lock.lock();
-    jq.jobs.push({pos, next_pos});
-    jq.lock.unlock();
-    jq.job_empty.notify_one();
-    pos = next_pos;
+ParallelReader::~ParallelReader() {
+  {
+    std::lock_guard<std::mutex> lg(lock);
+    stop.store(true);
   }
+  segment_ready.notify_all();
+  for (auto &t: thrs) t.join();
 }
 
-ParallelReader::~ParallelReader() {
-  stop.store(true);
-  for (auto jq: jqs) {
-    jq->job_empty.notify_one();
-    jq->thr.join();
-    delete jq;
+bool ParallelReader::claim(Job &job) {
+  std::lock_guard<std::mutex> lg(claim_lock);
+  if (claim_end) return false;
+  {
+    /* back pressure: a slow consumer holds at most 2 chunks per worker of
+       parsed but unconsumed actions */
+    std::unique_lock<std::mutex> ul(lock);
+    segment_ready.wait(ul, [&]() {
+      return claimed < next_segment + 2 * workers || stop.load();
+    });
+    if (stop.load()) return false;
+  }
+  /* parse rate per worker in bytes/ms, 100 MB/s until measured */
+  uint64_t ns = parse_ns.load();
+  uint64_t rate = ns > 10000000 ? parsed_bytes.load() * 1000000 / ns : 100000;
+  /* at least 5 ms of parsing per handoff, but 4 chunks per worker for small
+     files. at most 50 ms, which bounds buffered actions */
+  uint64_t lo = std::min<uint64_t>(std::max<uint64_t>(rate * 5, 64 << 10),
+                                   std::max<uint64_t>(file_size / (4 * workers),
+                                                      4 << 10));
+  uint64_t hi = std::max(lo, rate * 50);
+  uint64_t remaining = file_size - claim_pos;
+  auto size = std::min(std::max(remaining / (2 * workers), lo), hi);
+
+  job.seq = claimed++;
+  job.pos = claim_pos;
+  /* align end to line break */
+  claim_file.seekg(claim_pos + size);
+  std::string line;
+  std::getline(claim_file, line);
+  if (!claim_file.good() || static_cast<uint64_t>(claim_file.tellg()) >= file_size) {
+    claim_file.clear();
+    claim_pos = file_size;
+    claim_end = true;
+    std::lock_guard<std::mutex> lg(lock);
+    total_segment = claimed;
+  } else {
+    claim_pos = claim_file.tellg();
   }
+  job.end_pos = claim_pos;
+  return true;
 }
 
-void ParallelReader::worker(JobQueue *jq) {
+void ParallelReader::worker(size_t idx) {
+  placement.pin_reader(group, idx);
+  metrics.register_worker("parallel");
   std::ifstream file(file_name);
+  Job job;
   while (!stop.load()) {
-    std::unique_lock<std::mutex> ul(jq->lock);
-    jq->job_empty.wait(ul, [&]() { return !jq->jobs.empty() || stop.load(); });
-    if (jq->jobs.empty()) return;
-    auto job = jq->jobs.front();
-    jq->jobs.pop();
-    ul.unlock();
+    {
+      ScopedWait sw(Metrics::PARALLEL_WORKER);
+      if (!claim(job)) break;
+    }
+    auto start = Metrics::now_ns();
+    file.clear();
     file.seekg(job.pos);
 
     std::queue<Action> segment;
@@ -294,21 +501,32 @@ void ParallelReader::worker(JobQueue *jq) {
       if (a.inst == Action::END) break;
       segment.push(a);
     }
+    parsed_bytes.fetch_add(job.end_pos - job.pos);
+    parse_ns.fetch_add(Metrics::now_ns() - start);
 
-    ul.lock();
-    jq->actions.push(segment);
+    std::unique_lock<std::mutex> ul(lock);
+    segments.emplace(job.seq, std::move(segment));
     ul.unlock();
-    jq->action_empty.notify_one();
+    segment_ready.notify_all();
   }
+  /* file end claimed, consumer may be waiting for total_segment */
+  segment_ready.notify_all();
 }
 
 Action ParallelReader::next_action() {
-  while (current_block_of_action.empty() && next_segment < total_segment) {
-    auto jq = jqs[next_segment++ % workers];
-    std::unique_lock<std::mutex> ul(jq->lock);
-    jq->action_empty.wait(ul, [&](){ return !jq->actions.empty(); });
-    current_block_of_action = std::move(jq->actions.front());
-    jq->actions.pop();
+  while (current_block_of_action.empty()) {
+    ScopedWait sw(Metrics::PARALLEL_CONSUMER);
+    std::unique_lock<std::mutex> ul(lock);
+    segment_ready.wait(ul, [&]() {
+      return segments.count(next_segment) || next_segment >= total_segment;
+    });
+    if (next_segment >= total_segment) break;
+    auto it = segments.find(next_segment++);
+    current_block_of_action = std::move(it->second);
+    segments.erase(it);
+    ul.unlock();
+    /* a worker may wait in claim for this slot */
+    segment_ready.notify_all();
   }
   if (current_block_of_action.empty()) return Action();
 
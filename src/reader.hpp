@@ -1,27 +1,45 @@
 #ifndef __READER_HEADER__
 #define __READER_HEADER__
 
+#include <algorithm>
+#include <cmath>
 #include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <istream>
 #include <fstream>
+#include <map>
 #include <mutex>
 #include <thread>
 #include <vector>
 #include <queue>
+#include <regex>
 #include <string>
 #include <atomic>
+#include <unordered_set>
+
+#include "blockio.hpp"
+#include "instance.hpp"
+#include "metrics.hpp"
+#include "topology.hpp"
 
 typedef uint64_t Time;
 
 std::string pretty_time(Time t);
+Time parse_time(const std::string &); /* SEC.NSEC as in perf script, or NSEC */
+
+/* process wide symbol name interning, ids are dense and start from 1 */
+uint32_t intern_symbol(const std::string &);
+const std::string &symbol_name(uint32_t);
+size_t interned_symbols();
+/* drops all names, ids handed out before are invalid */
+void reset_interned_symbols();
 
 struct Symbol {
   std::string name;
-  uint64_t address;
-  uint64_t offset;
+  uint64_t address = 0;
+  uint64_t offset = 0;
   uint64_t base() const { return address ? address - offset : 0; }
   bool operator==(const Symbol &that) const { return address == that.address; }
   bool operator!=(const Symbol &that) const { return !(*this == that); }
@@ -35,12 +53,16 @@ struct Action {
     CALL, RET, JMP, JCC, TR_START, TR_END, TR_END_SYSCALL,
     /* only in kernel mode */
     SYSCALL, SYSRET, INT, IRET,
+    /* scheduler sideband, from sched:sched_switch and sched:sched_wakeup */
+    SCHED_SWITCH, SCHED_WAKEUP,
     END
   } inst;
+  bool preempted = false; /* SCHED_SWITCH: previous thread is runnable */
   Symbol from, to;
   Time ts;
-  size_t tid;
+  size_t tid; /* SCHED_SWITCH: previous thread, SCHED_WAKEUP: waker */
   size_t cpu;
+  size_t peer = 0; /* SCHED_SWITCH: next thread, SCHED_WAKEUP: woken */
 
   Action(): inst(END) {}
   bool operator==(const Action &that) const {
@@ -50,6 +72,79 @@ struct Action {
   bool operator!=(const Action &that) const { return !(*this == that); }
 };
 
+/* predicates pushed down into TraceReader, tid/cpu/time are checked right after
+   the line prefix is parsed so that rejected lines skip symbol parsing */
+struct ActionFilter {
+  std::unordered_set<size_t> tids;
+  std::unordered_set<size_t> cpus;
+  Time begin = 0;
+  Time end = UINT64_MAX;
+  /* keep lines with from or to symbol matching include, drop lines with both
+     from and to matching exclude. either breaks call stacks through dropped
+     lines, exclude is safe only if matched functions call nothing unmatched,
+     e.g. leaf helpers, whose time then stays in their unmatched caller */
+  bool has_include = false;
+  bool has_exclude = false;
+  std::regex include;
+  std::regex exclude;
+  uint64_t instance = new_instance_id(); /* of regexes, keys match cache */
+
+  void set_include(const std::string &re) {
+    include = std::regex(re, std::regex::optimize);
+    has_include = true;
+    instance = new_instance_id();
+  }
+  void set_exclude(const std::string &re) {
+    exclude = std::regex(re, std::regex::optimize);
+    has_exclude = true;
+    instance = new_instance_id();
+  }
+  /* approximate replay of a deterministic fraction of threads or of time
+     slices, chosen by hash of tid or slice number, see SampleEstimate */
+  enum SampleBy { SAMPLE_TID, SAMPLE_TIME };
+  SampleBy sample_by = SAMPLE_TID;
+  Time sample_slice = 1000000;
+  uint64_t sample_seed = 0;
+  uint64_t sample_below = UINT64_MAX; /* keep keys hashed below, all if max */
+
+  void set_sample(double fraction) {
+    sample_below = fraction >= 1 ? UINT64_MAX :
+                   static_cast<uint64_t>(std::ldexp(std::max(fraction, 0.0), 64));
+  }
+  bool sampled(uint64_t key) const {
+    uint64_t h = (key ^ sample_seed) + 0x9e3779b97f4a7c15;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return (h ^ (h >> 31)) < sample_below;
+  }
+  bool accept_prefix(size_t tid, size_t cpu, Time ts) const {
+    if (!tids.empty() && tids.find(tid) == tids.end()) return false;
+    if (!cpus.empty() && cpus.find(cpu) == cpus.end()) return false;
+    if (sample_below != UINT64_MAX &&
+        !sampled(sample_by == SAMPLE_TID ? tid : ts / sample_slice))
+      return false;
+    return ts >= begin && ts <= end;
+  }
+  /* sched lines are kept if either thread, tid or peer, is replayed. cpu
+     is not checked, threads are woken and switched in from any cpu */
+  bool accept_sched(const Action &a) const {
+    auto replayed = [&](size_t tid) {
+      return (tids.empty() || tids.find(tid) != tids.end()) &&
+             (sample_below == UINT64_MAX || sample_by != SAMPLE_TID ||
+              sampled(tid));
+    };
+    if (!replayed(a.tid) && !replayed(a.peer)) return false;
+    if (sample_below != UINT64_MAX && sample_by == SAMPLE_TIME &&
+        !sampled(a.ts / sample_slice))
+      return false;
+    return a.ts >= begin && a.ts <= end;
+  }
+  bool accept_symbols(const Action &) const;
+};
+
+/* no filtering if not set */
+extern ActionFilter *action_filter;
+
 struct GetAction {
   virtual ~GetAction() {}
   virtual Action next_action() = 0;
@@ -61,6 +156,9 @@ protected:
   const static std::vector<std::pair<const std::string, Action::Inst>> str2inst;
   static Action next_action_for_stream(std::istream &);
   static Action get_action_from_line(std::string &);
+public:
+  /* false if line is filtered or redundant, throws if line is malformed */
+  static bool parse_line(std::string &, Action &);
 };
 
 class BasicReader : public TraceReader {
@@ -75,14 +173,15 @@ public:
 class FileReader : public TraceReader {
   std::queue<std::istream *> iss;
 public:
-  FileReader(std::string f) { iss.push(new std::ifstream(f)); }
+  FileReader(std::string f) { iss.push(open_trace(f)); }
   FileReader(std::vector<std::string> &fs) {
-    for (auto &f: fs) iss.push(new std::ifstream(f));
+    for (auto &f: fs) iss.push(open_trace(f));
   }
   virtual Action next_action() {
     while (!iss.empty()) {
       auto a = next_action_for_stream(*iss.front());
       if (a.inst != Action::END) return a;
+      delete iss.front();
       iss.pop();
     }
     return Action();
@@ -95,10 +194,14 @@ public:
   }
 };
 
-/* reads streams until EOF in parallel, suitable for non-seekable stream */
+/* reads non-seekable streams until EOF. streams are parsed concurrently and
+   returned one after another. idle workers take the next unread stream,
+   segment length adapts from step so that each handoff carries a few ms of
+   parsing */
 class StreamReader : public TraceReader {
   size_t step;
   Time last = 0;
+  size_t group = placement.new_group();
 
   std::vector<std::thread> thrs;
   struct Stream {
@@ -107,18 +210,30 @@ class StreamReader : public TraceReader {
     std::mutex lock;
     std::condition_variable empty;
     std::atomic<bool> finished{false};
-    std::queue<std::queue<Action>> segments;
+    std::queue<std::pair<std::queue<Action>, size_t>> segments; /* bytes */
+    std::atomic<size_t> queued{0}; /* bytes in segments */
     Stream(std::istream *is): is(is) {}
-    Stream(std::string &f): from_file(true), is(new std::ifstream(f)) {}
+    Stream(std::string &f): from_file(true), is(open_trace(f)) {}
     ~Stream() { if (from_file) delete is; }
   };
 
+  /* bytes of parsed actions queued. the stream being consumed holds a few
+     segments, streams ahead of it, e.g. later perf script children, share a
+     large budget so they keep parsing while earlier ones are consumed, then
+     wait, and so does their writer once the pipe is full */
+  static const size_t max_queued = 64ul << 20;
+  static const size_t max_queued_ahead = 512ul << 20;
+  std::atomic<size_t> queued{0}; /* all streams */
+  std::mutex room_lock;
+  std::condition_variable room;
   std::vector<Stream *> streams;
+  std::atomic<size_t> next_stream{0};
   std::atomic<bool> stop{false};
+  bool has_room(size_t);
   void worker(size_t);
 
   std::queue<Action> current_segment;
-  size_t current_stream = 0;
+  std::atomic<size_t> current_stream{0};
 public:
   StreamReader(std::vector<std::string> &fs, size_t parallel, size_t step):
     step(step) {
@@ -130,46 +245,129 @@ public:
     streams.push_back(new Stream(is));
     thrs.push_back(std::thread(&StreamReader::worker, this, 0));
   }
+  /* consecutive streams produced concurrently, one worker each */
+  StreamReader(const std::vector<std::istream *> &iss, size_t step):
+    step(step) {
+    for (auto is: iss) streams.push_back(new Stream(is));
+    for (size_t i = 0; i < iss.size(); ++i)
+      thrs.push_back(std::thread(&StreamReader::worker, this, i));
+  }
 
   virtual ~StreamReader() {
     stop.store(true);
+    {
+      std::lock_guard<std::mutex> lg(room_lock);
+      room.notify_all();
+    }
     for (auto &t: thrs) t.join();
     for (auto s: streams) delete s;
   }
   virtual Action next_action();
 };
 
-/* parse single file in parallel, suitable for large file */
+/* parses a single large file with N workers. idle workers claim the next
+   chunk in file order, chunks are guided: a share of what remains, so they
+   start large and shrink toward the end, bounded by measured parse rate.
+   segments are returned in file order, at most 2 per worker are claimed
+   ahead of the consumer */
 class ParallelReader : public TraceReader {
   std::string file_name;
   size_t workers;
-  struct JobQueue {
-    std::thread thr;
-    struct Job {
-      long pos;
-      long end_pos;
-    };
-    std::queue<Job> jobs;
-    std::queue<std::queue<Action>> actions;
-    std::mutex lock;
-    std::condition_variable job_empty;
-    std::condition_variable action_empty;
+  size_t group = placement.new_group();
+  uint64_t file_size = 0;
+  std::vector<std::thread> thrs;
+
+  struct Job {
+    size_t seq;
+    long pos;
+    long end_pos;
   };
+  std::mutex claim_lock;
+  std::ifstream claim_file; /* aligns chunk ends to line breaks */
+  long claim_pos = 0;
+  size_t claimed = 0;
+  bool claim_end = false;
+  /* summed over workers, i.e. per worker parse rate */
+  std::atomic<uint64_t> parsed_bytes{0};
+  std::atomic<uint64_t> parse_ns{0};
+  bool claim(Job &);
+
+  std::mutex lock;
+  std::condition_variable segment_ready;
+  std::map<size_t, std::queue<Action>> segments; /* by seq */
+  size_t total_segment = SIZE_MAX; /* known once file end is claimed */
 
-  std::vector<JobQueue *> jqs;
   std::atomic<bool> stop{false};
-  void worker(JobQueue *);
+  void worker(size_t);
 
   std::queue<Action> current_block_of_action;
-  size_t total_segment{0};
-  size_t next_segment{0};
+  size_t next_segment{0}; /* under lock, claim waits on it */
 
 public:
-  ParallelReader(std::string, size_t, size_t);
+  ParallelReader(std::string, size_t);
   virtual ~ParallelReader();
   virtual Action next_action();
 };
 
+/* sorts slightly out of order input, e.g. perf.data split at arbitrary
+   points or per-cpu decode with clock skew. an action is released once input
+   has advanced horizon ns past it, or buffer is full. actions older than the
+   last released one are late, they are released at once and counted */
+class ReorderWrapper : public GetAction {
+  GetAction *tr;
+  Time horizon;
+  size_t capacity;
+
+  struct Entry {
+    Action act;
+    uint64_t seq; /* keeps input order for equal timestamps */
+    bool operator<(const Entry &that) const {
+      if (act.ts != that.act.ts) return act.ts > that.act.ts;
+      return seq > that.seq;
+    }
+  };
+  std::priority_queue<Entry> heap;
+  uint64_t seq = 0;
+  Time newest = 0;
+  Time released = 0;
+  bool input_end = false;
+
+  uint64_t late = 0;
+  Time max_late = 0;
+public:
+  ReorderWrapper(GetAction *tr, Time horizon, size_t capacity = 1 << 20):
+    tr(tr), horizon(horizon), capacity(capacity) {}
+  virtual ~ReorderWrapper() {
+    if (late)
+      std::cerr << "reorder: " << late << " late actions, at most "
+                << max_late << " ns behind" << std::endl;
+  }
+
+  virtual Action next_action() {
+    while (!input_end && heap.size() < capacity &&
+           (heap.empty() || newest - heap.top().act.ts < horizon)) {
+      auto a = tr->next_action();
+      if (a.inst == Action::END) {
+        input_end = true;
+        break;
+      }
+      if (a.ts < released) {
+        late++;
+        max_late = std::max(max_late, released - a.ts);
+        metrics.late.fetch_add(1, std::memory_order_relaxed);
+        return a;
+      }
+      newest = std::max(newest, a.ts);
+      heap.push({std::move(a), seq++});
+    }
+    if (heap.empty()) return Action();
+    auto ret = heap.top().act;
+    heap.pop();
+    released = ret.ts;
+    return ret;
+  }
+};
+
 class MergeWrapper : public GetAction {
   bool single_source = false;
   GetAction *tr;
@@ -185,6 +383,16 @@ class MergeWrapper : public GetAction {
 
   std::queue<Action> block;
   std::priority_queue<ActionWrapper> action_heap;
+
+  /* published to metrics in batches to keep the hot path cheap */
+  uint64_t unpublished = 0;
+  Action counted(Action &&a) {
+    if (a.inst != Action::END && ++unpublished == 4096) {
+      metrics.merged.fetch_add(unpublished, std::memory_order_relaxed);
+      unpublished = 0;
+    }
+    return std::move(a);
+  }
 public:
   MergeWrapper(std::vector<GetAction *> trs) {
     /* do a single read from all files to populate action_heap */
@@ -194,24 +402,28 @@ public:
     } else for (auto tr: trs) action_heap.push({tr->next_action(), tr});
   }
 
+  virtual ~MergeWrapper() {
+    metrics.merged.fetch_add(unpublished, std::memory_order_relaxed);
+  }
+
   virtual Action next_action() {
-    if (single_source) return tr->next_action();
+    if (single_source) return counted(tr->next_action());
     while (!action_heap.empty()) {
       auto act = action_heap.top();
       action_heap.pop();
       if (act.act.inst == Action::END) continue;
       action_heap.push({std::move(act.tr->next_action()), act.tr});
-      return act.act;
+      return counted(std::move(act.act));
     }
     return Action();
   }
 
   Action next_action_by_block() {
-    if (single_source) return tr->next_action();
+    if (single_source) return counted(tr->next_action());
     if (!block.empty()) {
       auto ret = block.front();
       block.pop();
-      return ret;
+      return counted(std::move(ret));
     }
 
     while (!action_heap.empty()) {
@@ -225,7 +437,7 @@ public:
       }
       if (next.inst != Action::END)
         action_heap.push({std::move(next), act.tr});
-      return act.act;
+      return counted(std::move(act.act));
     }
     return Action();
   }
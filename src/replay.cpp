@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cstdint>
 #include <cstdlib>
+#include <functional>
 #include <string>
 #include <thread>
 #include <vector>
@@ -15,6 +16,10 @@
 /* fake root function with impossible non-zero address */
 static const Symbol global_root_function = {"/global_root/", 0x10, 0};
 static const Symbol suspended_function = {"/suspended/", 0x20, 0};
+static const Symbol blocked_function = {"/blocked/", 0x30, 0};
+static const Symbol runnable_function = {"/runnable/", 0x40, 0};
+static const Symbol wakeup_function = {"[wakeup]", 0x50, 0};
+static const size_t waker_max_depth = 16;
 static const std::string perf_event_switch_symbol = "perf_event_switch_output";
 static const size_t try_match_max_depth = 10;
 
@@ -44,40 +49,52 @@ Func *Func::destructive_merge_funcs(std::vector<Func *> &fs) {
   return root;
 }
 
+Func *Func::find_or_add_callee(const Symbol &s) {
+  auto f = find_callee(s);
+  if (f) return f;
+  f = new Func(s, this, UINT64_MAX, tid);
+  callee.push_back(f);
+  return f;
+}
+
+void Func::merge_copy(const Func *that) {
+  stats.merge_stat(that->stats);
+  for (auto f: that->callee) find_or_add_callee(f->sym)->merge_copy(f);
+}
+
 Func *Func::call(const Symbol &from, const Symbol &s, Time ts) {
   call_address = from.address;
   auto f = find_callee(s);
   if (f) {
     f->start = ts;
     f->end = 0;
+    f->span_id = 0;
     f->start_is_inferred = false;
   } else {
     f = new Func(s, this, ts, tid);
     callee.push_back(f);
   }
 
-  if (perfetto)
-    perfetto->emit_function(tid, tid, f->sym.name, ts, Perfetto::EventType::BEGIN);
+  if (perfetto) perfetto->emit_call(tid, tid, f->id(), f->sym.name, ts);
   return f;
 }
 
 Func *Func::ret(Time ts) {
+  if (latency && start <= ts)
+    latency->record(this, ts, start_is_inferred || end_is_inferred);
+  if (spans && start <= ts) spans->record(this, ts);
+  if (lock_waits && start <= ts) lock_waits->record(this, ts);
+  if (perfetto)
+    perfetto->emit_return(tid, tid, id(), sym.name, start, ts,
+                          start_is_inferred);
   if (start > ts) {
     std::cerr << "Warning: function " << sym.name << " return time " << ts
               << " earlier than start " << start << std::endl << std::flush;
     stats.add_sample(0, true);
-  }
-  else stats.add_sample(ts - start, start_is_inferred || end_is_inferred);
+  } else stats.add_sample(ts - start, start_is_inferred || end_is_inferred);
   end = ts;
   start = UINT64_MAX;
   if (caller) caller->call_address = 0;
-
-  if (perfetto) {
-    if (start_is_inferred)
-      perfetto->emit_function(tid, tid, sym.name, start, Perfetto::EventType::COMPLETE, ts);
-    else
-      perfetto->emit_function(tid, tid, sym.name, ts, Perfetto::EventType::END);
-  }
   return caller;
 };
 
@@ -95,6 +112,8 @@ void Func::flame_graph(std::ostream &os) {
 void Func::_flame_graph(std::ostream &os, std::string prefix, bool hide_zero) {
   if (stats.sum_inferred == 0) return;
   std::string display_name = sym.name + ':' + stats.stat_string();
+  if (error >= 0)
+    display_name += ",err:" + std::to_string(std::lround(error)) + '%';
   os << prefix << display_name << ' ' << self_time() << std::endl;
   for (auto f: callee)
     f->_flame_graph(os, prefix + display_name + ';', hide_zero);
@@ -112,6 +131,14 @@ Time Func::self_time() {
   return stats.sum_inferred - other;
 }
 
+Time Func::graph_self_time() {
+  if (!off_cpu()) return self_time();
+  Time other = 0;
+  for (auto i: callee)
+    if (graph_callee(i)) other += i->stats.sum_inferred;
+  return stats.sum_inferred - std::min(stats.sum_inferred, other);
+}
+
 Func *Func::find_callee(const Symbol &s) {
   for (auto f: callee) if (f->sym.base() == s.base()) return f;
   for (auto f: callee) if (f->name_match(s)) return f;
@@ -139,9 +166,12 @@ void History::make_new_root(const Symbol &s) {
       new Func({s.name, s.address - s.offset, 0}, nullptr,
                root->first_start - 1, tid);
   new_root->start_is_inferred = true;
+  new_root->depth = root->depth - 1;
   root->caller = new_root;
   new_root->callee.push_back(root);
   root = new_root;
+  /* every cached stack hash below old root is stale */
+  Func::generation.fetch_add(1, std::memory_order_relaxed);
 }
 
 bool History::call(const Symbol &from, const Symbol &to, Time ts) {
@@ -189,6 +219,7 @@ History::History(const Symbol &s, Time ts, size_t c, size_t t):
       new Func({s.name, s.address - s.offset, 0}, nullptr, ts, tid);
 }
 
+template <typename Mode>
 bool History::replay(const Action &action) {
   bool delete_hist = false;
   bool r = false;
@@ -197,62 +228,64 @@ bool History::replay(const Action &action) {
     return false;
 
   /* kernel trace mitigations from limited test on alikernel 5.10 */
-  if (task_switch_flush_task) {
-    /* special case for kprobe_flush_task and prepare_task_switch
-       this is callback(?) hook for kernel tasks and is checked just before
-       task switch returns to user thread. trace is briefly disabled(?) and we
-       lost one or two stack level.
-       we don't care about perf copying data (and other kernel tasks), so don't
-       attempt to recreate stack during this function
-     */
-    if (action.inst != Action::RET) return true;
-    if (action.to.name == "finish_task_switch") {
-      /* stack: * > __schedule > finish_task_switch > kprobe_flush_task */
-      task_switch_flush_task = false;
-      return ret(current->sym, action.to, action.ts);
-    } else if (action.to.name == "prepare_task_switch") {
-      /* stack: * > __schedule > prepare_task_switch */
-      task_switch_flush_task = false;
-    }
-    return true;
-  } else if (enter_lazy_tlb) {
-    /* special case for enter_lazy_tlb, where kernel will soon reschedule (?)
-       tid may not be accurate (?), trace breaks repeatedly, so wait for this
-       pattern before continuing
-       tr strt [unknown] -> schedule
-       return  schedule -> <some symbol in call stack> */
-    if (enter_lazy_tlb == 1) {
-      if (action.inst != Action::TR_START) return true; /* ignore */
-      if (!action.from.is_unknown()) {
-        /* data loss */
-        enter_lazy_tlb = 0;
-        return false;
+  if constexpr (Mode::kernel) {
+    if (task_switch_flush_task) {
+      /* special case for kprobe_flush_task and prepare_task_switch
+         this is callback(?) hook for kernel tasks and is checked just before
+         task switch returns to user thread. trace is briefly disabled(?) and we
+         lost one or two stack level.
+         we don't care about perf copying data (and other kernel tasks), so don't
+         attempt to recreate stack during this function
+       */
+      if (action.inst != Action::RET) return true;
+      if (action.to.name == "finish_task_switch") {
+        /* stack: * > __schedule > finish_task_switch > kprobe_flush_task */
+        task_switch_flush_task = false;
+        return ret(current->sym, action.to, action.ts);
+      } else if (action.to.name == "prepare_task_switch") {
+        /* stack: * > __schedule > prepare_task_switch */
+        task_switch_flush_task = false;
       }
-      if (action.to.name != "schedule") return true; /* ignore */
-      enter_lazy_tlb = 2;
       return true;
-    } else {
-      enter_lazy_tlb = 0;
-      switch (action.inst) {
-      case Action::CALL:
-        enter_lazy_tlb = 1;
+    } else if (enter_lazy_tlb) {
+      /* special case for enter_lazy_tlb, where kernel will soon reschedule (?)
+         tid may not be accurate (?), trace breaks repeatedly, so wait for this
+         pattern before continuing
+         tr strt [unknown] -> schedule
+         return  schedule -> <some symbol in call stack> */
+      if (enter_lazy_tlb == 1) {
+        if (action.inst != Action::TR_START) return true; /* ignore */
+        if (!action.from.is_unknown()) {
+          /* data loss */
+          enter_lazy_tlb = 0;
+          return false;
+        }
+        if (action.to.name != "schedule") return true; /* ignore */
+        enter_lazy_tlb = 2;
         return true;
-      case Action::RET:
-        if (action.from.name != "schedule") return false;
-        return ret(action.from, action.to, action.ts);
-      default: return false;
+      } else {
+        enter_lazy_tlb = 0;
+        switch (action.inst) {
+        case Action::CALL:
+          enter_lazy_tlb = 1;
+          return true;
+        case Action::RET:
+          if (action.from.name != "schedule") return false;
+          return ret(action.from, action.to, action.ts);
+        default: return false;
+        }
       }
+    } else if (perf_event_switch_output) {
+      perf_event_switch_output = false;
+      /* handle this specific case:
+         tr strt  [unknown] -> perf_event_switch_output
+         return   perf_event_switch_output -> <some symbol in call stack> */
+      if (action.inst != Action::RET ||
+          action.from.name != perf_event_switch_symbol)
+        return false;
+      /* from won't match current, but History::ret handles this discrepancy */
+      return ret(action.from, action.to, action.ts);
     }
-  } else if (perf_event_switch_output) {
-    perf_event_switch_output = false;
-    /* handle this specific case:
-       tr strt  [unknown] -> perf_event_switch_output
-       return   perf_event_switch_output -> <some symbol in call stack> */
-    if (action.inst != Action::RET ||
-        action.from.name != perf_event_switch_symbol)
-      return false;
-    /* from won't match current, but History::ret handles this discrepancy */
-    return ret(action.from, action.to, action.ts);
   }
 
   /* trace around syscall looks like
@@ -260,7 +293,7 @@ bool History::replay(const Action &action) {
      2. call entry_SYSCALL_64_after_hwframe+0x3f => do_syscall_64+0x0
      there is a known symbol mismatch, insert a call to connect stack
    */
-  if (after_syscall) {
+  if (Mode::kernel && after_syscall) {
     if (action.inst != Action::CALL) return false;
     if (current->sym != action.from)
       if (!call(current->sym, action.from, action.ts)) return false;
@@ -298,18 +331,22 @@ bool History::replay(const Action &action) {
       /* resuming from trace end, do nothing */
       pause_address = 0;
       return ret(suspended_function, action.to, action.ts);
-    } else if (current->sym.name == "kprobe_flush_task" ||
-               current->sym.name == "prepare_task_switch") {
-      task_switch_flush_task = true;
-      return true;
-    } else if (current->sym.name == "enter_lazy_tlb") {
-      enter_lazy_tlb = 1;
-      return true;
-    } else if (action.from.is_unknown() &&
-               action.to.name == perf_event_switch_symbol) {
-      perf_event_switch_output = true;
-      return true;
-    } else if (action.from.base() == 0 && action.to.is_unknown()) {
+    }
+    if constexpr (Mode::kernel) {
+      if (current->sym.name == "kprobe_flush_task" ||
+          current->sym.name == "prepare_task_switch") {
+        task_switch_flush_task = true;
+        return true;
+      } else if (current->sym.name == "enter_lazy_tlb") {
+        enter_lazy_tlb = 1;
+        return true;
+      } else if (action.from.is_unknown() &&
+                 action.to.name == perf_event_switch_symbol) {
+        perf_event_switch_output = true;
+        return true;
+      }
+    }
+    if (action.from.base() == 0 && action.to.is_unknown()) {
       /* special case for
          call     clock_gettime@GLIBC_2.2.5 => __vdso_clock_gettime
          tr strt  0 [unknown] => 7fff56f8ca49 [unknown]
@@ -319,15 +356,81 @@ bool History::replay(const Action &action) {
       return call(current->sym, action.to, action.ts);
     }
     return false;
+  case Action::SCHED_SWITCH: case Action::SCHED_WAKEUP: /* see Replay */
   case Action::END: return false;
   }
   return false;
 }
 
+std::vector<Symbol> History::stack(size_t max_depth) const {
+  std::vector<Symbol> ret;
+  for (auto f = current; f && ret.size() < max_depth; f = f->caller)
+    ret.push_back(f->sym);
+  std::reverse(ret.begin(), ret.end());
+  return ret;
+}
+
+void History::switch_out(Time ts, bool p) {
+  switched_out = ts;
+  preempted = p;
+  woken = 0;
+  waker.clear();
+}
+
+void History::wakeup(Time ts, std::vector<Symbol> &&w) {
+  if (!switched_out || preempted) return;
+  woken = ts;
+  waker = std::move(w);
+}
+
+bool Func::off_cpu() const {
+  return sym == suspended_function || sym == blocked_function ||
+         sym == runnable_function;
+}
+
+/* frame for time off cpu. added without call and ret, so hooks such as
+   perfetto, latency, spans and lock waits only see traced invocations.
+   waker frames only carry the blocked time, they were not invoked by it */
+static Func *add_off_cpu(Func *caller, const Symbol &s, Time begin, Time end,
+                         bool invoked = true) {
+  auto f = caller->find_or_add_callee(s);
+  if (invoked) {
+    f->stats.add_sample(end - begin, false);
+  } else {
+    f->stats.sum_inferred += end - begin;
+    f->stats.sum += end - begin;
+  }
+  f->first_start = std::min(f->first_start, begin);
+  f->end = end;
+  return f;
+}
+
+void History::switch_in(Time ts) {
+  if (!switched_out || switched_out > ts) return;
+  /* within current frame, e.g. if trace resumed before switch in */
+  auto begin = std::max(switched_out, std::min(current->start, ts));
+  auto runnable_from = begin;
+  if (!preempted) {
+    /* blocked until woken, or whole interval if wakeup is not recorded */
+    auto end = woken >= begin && woken <= ts ? woken : ts;
+    auto blocked = add_off_cpu(current, blocked_function, begin, end);
+    if (!waker.empty()) {
+      auto f = add_off_cpu(blocked, wakeup_function, begin, end);
+      for (auto &s: waker) f = add_off_cpu(f, s, begin, end, false);
+    }
+    runnable_from = end;
+  }
+  if (runnable_from < ts)
+    add_off_cpu(current, runnable_function, runnable_from, ts);
+  switched_out = 0;
+  woken = 0;
+  waker.clear();
+}
+
 Func *History::terminate() {
   /* end all currently open function calls and accumulate latencies
      estimate low bound of return time */
-  Time ts = pause_address ? pause_time : current->last_time();
+  Time ts = last_time();
   while (current != root) {
     current->end_is_inferred = true;
     current = current->ret(ts);
@@ -366,19 +469,109 @@ void History::snapshot(std::ostream &os) {
   }
 }
 
+static const char *inst_names[] = {
+  "call", "return", "jmp", "jcc", "tr strt", "tr end", "tr end syscall",
+  "syscall", "sysret", "hw int", "iret", "sched switch", "sched wakeup",
+  "end"
+};
+
+void LossStats::record(const Action &action, const std::string &top) {
+  total++;
+  by_inst[action.inst]++;
+  by_symbol[top]++;
+  by_tid[action.tid]++;
+  by_time[action.ts / bucket * bucket]++;
+}
+
+/* self time weighted, so nested frames are not counted twice */
+static void inferred_time(Func *f, double &inferred, double &total) {
+  auto self = f->self_time();
+  inferred += self * f->stats.inferred_fraction();
+  total += self;
+  for (auto c: f->callee) inferred_time(c, inferred, total);
+}
+
+template <typename Map>
+static void print_top(std::ostream &os, const Map &m, size_t n) {
+  std::vector<std::pair<typename Map::key_type, uint64_t>> v(m.begin(), m.end());
+  std::sort(v.begin(), v.end(), [](const auto &a, const auto &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  if (v.size() > n) v.resize(n);
+  for (auto &[k, count]: v) os << "  " << count << '\t' << k << std::endl;
+}
+
+void LossStats::report(std::ostream &os, Func *root, uint64_t actions,
+                       size_t top_n) {
+  os << "mismatches: " << total << " in " << actions << " actions";
+  if (actions)
+    os << ", " << std::setprecision(1) << std::fixed
+       << total * 1e6 / actions << " per million";
+  os << std::endl;
+  if (root) {
+    double inferred = 0, all = 0;
+    for (auto c: root->callee) inferred_time(c, inferred, all);
+    os << "inferred time: " << std::setprecision(2) << std::fixed
+       << (all ? inferred * 100 / all : 0) << "% of wall time" << std::endl;
+  }
+  os << std::defaultfloat;
+  if (!total) return;
+  os << "by instruction:" << std::endl;
+  for (int i = 0; i <= Action::END; ++i)
+    if (by_inst[i]) os << "  " << by_inst[i] << '\t' << inst_names[i] << std::endl;
+  os << "by top of stack:" << std::endl;
+  print_top(os, by_symbol, top_n);
+  os << "by tid:" << std::endl;
+  print_top(os, by_tid, top_n);
+  os << "over time, every " << pretty_time(bucket) << ":" << std::endl;
+  for (auto &[ts, n]: by_time)
+    os << "  " << n << '\t' << pretty_time(ts) << std::endl;
+}
+
 void Replay::stop_and_archive(size_t tid) {
   auto root = threads.at(tid).terminate();
   archive.push_back(root);
   threads.erase(tid);
+  metrics.archived.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Replay::sched(const Action &action) {
+  if (action.inst == Action::SCHED_WAKEUP) {
+    auto woken = threads.find(action.peer);
+    if (woken == threads.end()) return;
+    auto waker = threads.find(action.tid);
+    woken->second.wakeup(action.ts, waker == threads.end() ?
+                         std::vector<Symbol>() :
+                         waker->second.stack(waker_max_depth));
+    return;
+  }
+  auto prev = threads.find(action.tid);
+  if (prev != threads.end()) prev->second.switch_out(action.ts, action.preempted);
+  auto next = threads.find(action.peer);
+  if (next != threads.end()) next->second.switch_in(action.ts);
 }
 
-bool Replay::replay(const Action &action) {
+template <typename TraceMode>
+bool Replay::replay_as(const Action &action) {
+  /* spans record cpu of the instruction that ends them */
+  if (spans) spans->set_cpu(action.cpu);
+  if (action.ts >= next_sample) sample(action.ts);
+  actions++;
+  if (++unpublished == 4096) {
+    metrics.replayed.fetch_add(unpublished, std::memory_order_relaxed);
+    unpublished = 0;
+  }
+  if (action.inst == Action::SCHED_SWITCH ||
+      action.inst == Action::SCHED_WAKEUP) {
+    sched(action);
+    return true;
+  }
   auto hist = threads.find(action.tid);
   if (hist == threads.end()) {
     if (action.to.is_unknown()) return true;
     /* found new thread */
     threads.emplace(std::make_pair(action.tid, History(action)));
-  } else if (!hist->second.replay(action)) {
+  } else if (!hist->second.template replay<TraceMode>(action)) {
     // if (hist->second.current_depth() > 2) {
     //   std::cerr << "TRACE BROKEN for tid " << action.tid << std::endl;
     //   hist->second.print_status(std::cerr);
@@ -388,6 +581,8 @@ bool Replay::replay(const Action &action) {
     //             << std::endl;
     // }
     // archive current history and start a new one for current thread
+    metrics.mismatches.fetch_add(1, std::memory_order_relaxed);
+    loss.record(action, hist->second.top()->sym.name);
     stop_and_archive(action.tid);
     threads.emplace(std::make_pair(action.tid, History(action)));
   }
@@ -395,6 +590,187 @@ bool Replay::replay(const Action &action) {
   return true;
 }
 
+template bool Replay::replay_as<UserTrace>(const Action &);
+template bool Replay::replay_as<KernelTrace>(const Action &);
+
+void Replay::sample(Time ts) {
+  auto interval = samples->interval;
+  if (next_sample == 0) next_sample = ts - ts % interval;
+  /* stacks are unchanged since last action, so sample points in a gap
+     are counted at once */
+  uint64_t n = (ts - next_sample) / interval + 1;
+  next_sample += n * interval;
+  for (auto &[tid, hist]: threads) samples->add(hist.top(), n);
+  samples->samples += n;
+}
+
+void StackSamples::add(Func *top, uint64_t n) {
+  auto &e = stacks[top->stack_hash()];
+  if (e.ids.empty()) {
+    for (auto f = top; f; f = f->caller) e.ids.push_back(f->id());
+    std::reverse(e.ids.begin(), e.ids.end());
+  }
+  e.count += n;
+}
+
+void StackSamples::write(std::ostream &os, Format format) {
+  std::vector<const Entry *> sorted;
+  for (auto &[hash, e]: stacks) sorted.push_back(&e);
+  std::sort(sorted.begin(), sorted.end(), [](const Entry *a, const Entry *b) {
+    return a->count != b->count ? a->count > b->count : a->ids < b->ids;
+  });
+  /* one write per block, os is often unbuffered stderr */
+  std::string buf;
+  auto flush = [&](size_t above) {
+    if (buf.size() <= above) return;
+    os.write(buf.data(), buf.size());
+    buf.clear();
+  };
+  if (format == PMP) {
+    std::ostringstream header;
+    header << samples << " samples every " << interval << " ns, "
+           << stacks.size() << " distinct stacks\n";
+    buf = header.str();
+  }
+  for (auto e: sorted) {
+    if (format == FOLDED) {
+      for (size_t i = 0; i < e->ids.size(); ++i) {
+        if (i) buf += ';';
+        buf += symbol_name(e->ids[i]);
+      }
+      buf += ' ' + std::to_string(e->count) + '\n';
+    } else {
+      auto count = std::to_string(e->count);
+      if (count.size() < 8) buf.append(8 - count.size(), ' ');
+      buf += count + ' ';
+      for (auto it = e->ids.rbegin(); it != e->ids.rend(); ++it) {
+        if (it != e->ids.rbegin()) buf += ',';
+        buf += symbol_name(*it);
+      }
+      buf += '\n';
+    }
+    flush(1 << 16);
+  }
+  flush(0);
+  os.flush();
+}
+
+/* slice node is only added once something below it changed since the
+   previous cut */
+struct Replay::SliceNode {
+  SliceNode *parent;
+  const Symbol *sym;
+  Func *f;
+  Func *get() {
+    if (!f) f = parent->get()->find_or_add_callee(*sym);
+    return f;
+  }
+};
+
+Func::Statistics &Replay::add_reported(Func *f) {
+  if (free_reported.empty()) {
+    f->cut_slot = reported.size();
+    reported.emplace_back();
+  } else {
+    f->cut_slot = free_reported.back();
+    free_reported.pop_back();
+    reported[f->cut_slot] = Func::Statistics();
+  }
+  f->cut_gen = reported_gen;
+  return reported[f->cut_slot];
+}
+
+void Replay::cut_node(SliceNode &parent, Func *f, Time ts, Time changed) {
+  /* ts is the end of open invocations, as terminate would estimate it */
+  auto sub = [](auto a, auto b) { return a > b ? a - b : 0; };
+  if (f->cut_gen == reported_gen) {
+    /* nothing below a frame changes after it returns */
+    if (!f->is_active() && f->end < changed) return;
+  } else {
+    auto &st = add_reported(f);
+    /* nodes are first seen in the cut after they are added, unless they
+       are put above earlier frames, e.g. a new root. their time before
+       the previous cut was written as that of the frames below */
+    if (f->first_start < last_cut) st.sum_inferred = last_cut - f->first_start;
+  }
+  /* not kept across the recursion below, which may add slots */
+  auto &old = reported[f->cut_slot];
+  auto now = f->stats;
+  if (f->is_active() && f->start < ts) now.sum_inferred += ts - f->start;
+  SliceNode node = {&parent, &f->sym, nullptr};
+  if (now.sum_inferred > old.sum_inferred || now.invoked > old.invoked) {
+    auto &st = node.get()->stats;
+    st.sum_inferred += sub(now.sum_inferred, old.sum_inferred);
+    st.sum += sub(now.sum, old.sum);
+    st.invoked += sub(now.invoked, old.invoked);
+    st.inferred += sub(now.inferred, old.inferred);
+    old = now;
+  }
+  for (auto c: f->callee) cut_node(node, c, ts, changed);
+}
+
+Func *Replay::cut(Time ts) {
+  auto slice = new Func(global_root_function, nullptr, ts, 0);
+  SliceNode top = {nullptr, nullptr, slice};
+  for (auto &[tid, hist]: threads)
+    cut_node(top, hist.tree(), std::min(ts, hist.last_time()), last_cut);
+  /* archived trees do not change, forget them once written */
+  std::function<void(Func *)> forget = [&](Func *f) {
+    if (f->cut_gen == reported_gen) {
+      free_reported.push_back(f->cut_slot);
+      f->cut_gen = 0;
+    }
+    for (auto c: f->callee) forget(c);
+  };
+  for (; reported_archive < archive.size(); ++reported_archive) {
+    auto r = archive[reported_archive];
+    /* terminate may return frames before the previous cut */
+    for (auto c: r->callee) cut_node(top, c, 0, 0);
+    forget(r);
+  }
+  last_cut = ts;
+  return slice;
+}
+
+Func *Replay::take(Time ts) {
+  auto slice = cut(ts);
+  for (auto r: archive) delete r;
+  archive.clear();
+  reported_archive = 0;
+  clear_reported();
+  /* open time up to the cut is in the slice */
+  Time end;
+  std::function<void(Func *)> prune = [&](Func *f) {
+    f->stats = Func::Statistics();
+    if (f->start < end) add_reported(f).sum_inferred = end - f->start;
+    auto it = std::remove_if(f->callee.begin(), f->callee.end(), [&](Func *c) {
+      if (c->is_active()) {
+        prune(c);
+        return false;
+      }
+      if (c->caller == f) delete c;
+      return true;
+    });
+    f->callee.erase(it, f->callee.end());
+  };
+  for (auto &[tid, hist]: threads) {
+    end = std::min(ts, hist.last_time());
+    prune(hist.tree());
+  }
+  /* nothing cut before is left after cleanup, the next capture may start
+     back in time */
+  if (threads.empty()) last_cut = 0;
+  return slice;
+}
+
+Func *Replay::merged_copy() const {
+  auto root = new Func(global_root_function, nullptr, 0, 0);
+  for (auto r: archive) root->merge_copy(r);
+  for (auto &[tid, hist]: threads)
+    root->find_or_add_callee(hist.tree()->sym)->merge_copy(hist.tree());
+  return root;
+}
+
 ParallelReplay::ParallelReplay(size_t worker): stop(false) {
   for (size_t i = 0; i < worker; ++i) {
     rps.push_back(new AsyncReplay);
@@ -415,7 +791,10 @@ ParallelReplay::~ParallelReplay() {
 void ParallelReplay::replay_worker(AsyncReplay *rp, std::atomic<bool> *stop) {
   while (!stop->load()) {
     std::unique_lock<std::mutex> ul(rp->lock);
-    while (rp->actions.empty() && !stop->load()) rp->empty.wait(ul);
+    if (rp->actions.empty() && !stop->load()) {
+      ScopedWait sw(Metrics::REPLAY_WORKER);
+      while (rp->actions.empty() && !stop->load()) rp->empty.wait(ul);
+    }
     if (stop->load()) return;
     auto action = rp->actions.front();
     rp->actions.pop();
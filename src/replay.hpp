@@ -1,6 +1,7 @@
 #ifndef __REPLAY_HEADER__
 #define __REPLAY_HEADER__
 
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdlib>
@@ -10,9 +11,14 @@
 #include <map>
 #include <vector>
 #include <sstream>
+#include <unordered_map>
 
 #include "reader.hpp"
 #include "perfetto.hpp"
+#include "latency.hpp"
+#include "lockwait.hpp"
+#include "metrics.hpp"
+#include "spans.hpp"
 
 struct Func {
   Symbol sym;
@@ -20,6 +26,19 @@ struct Func {
   Func *caller;
   size_t call_address;
   size_t tid; /* only meaningful when function is active */
+  uint32_t sym_id = 0; /* lazily interned, see id() */
+  int32_t depth = 0; /* relative to first root of thread, may be negative */
+  uint64_t span_id = 0; /* id of current invocation, see SpanWriter */
+  /* hash of call stack from thread root, valid while hash_gen is current */
+  uint64_t hash = 0;
+  uint32_t hash_gen = 0;
+  uint32_t sym_gen = 0; /* sym_id is valid while sym_gen is current */
+  /* stats written to earlier cuts, see Replay::cut */
+  uint32_t cut_slot = 0;
+  uint32_t cut_gen = 0; /* cut_slot is valid while cut_gen is current */
+  static inline std::atomic<uint32_t> generation{1}; /* bumped on re-root */
+  /* bumped when interned symbols are dropped, see Session::Impl::rotate */
+  static inline std::atomic<uint32_t> symbol_generation{1};
 
   Time first_start = UINT64_MAX;
   /* most recent start and end time, only meaningful before merging functions */
@@ -27,13 +46,20 @@ struct Func {
   Time end = 0;
   bool start_is_inferred = false;
   bool end_is_inferred = false;
+  float error = -1; /* % error of self time in sampled replay, see SampleEstimate */
 
   struct Statistics {
-    Time sum_inferred = 0;
+    static inline bool show_inferred = false; /* inf% in stat_string */
+    Time sum_inferred = 0; /* all samples, despite the name */
     Time sum = 0;
     size_t invoked = 0;
     size_t inferred = 0; /* call/ret time of this function is inferred */
     size_t n() { return invoked - inferred; }
+    /* share of time from invocations with inferred start or end */
+    double inferred_fraction() const {
+      if (sum_inferred == 0) return 0;
+      return static_cast<double>(sum_inferred - sum) / sum_inferred;
+    }
     double average() {
       if (n() == 0) return 0;
       return static_cast<double>(sum) / (invoked - inferred);
@@ -60,18 +86,30 @@ struct Func {
       if (inferred) str << '(' << inferred << ')';
       if (n() > 1)
         str << ",avg:" << std::setprecision(0) << std::fixed << average();
+      if (show_inferred && sum_inferred > sum)
+        str << ",inf:" << std::setprecision(0) << std::fixed
+            << inferred_fraction() * 100 << '%';
       return str.str();
     }
   } stats;
 
   Func(Symbol s, Func *c, Time t, size_t tid):
-    sym(s), caller(c), first_start(t), start(t), tid(tid) {}
+    sym(s), caller(c), first_start(t), start(t), tid(tid),
+    depth(c ? c->depth + 1 : 0) {
+    Metrics::func_allocated();
+  }
   ~Func() {
     for (auto &f : callee) if (f->caller == this) delete f;
+    Metrics::func_freed();
   }
 
   void destructive_merge(Func *);
   static Func *destructive_merge_funcs(std::vector<Func *> &);
+  void merge_copy(const Func *); /* non-destructive merge for live trees */
+  Func *find_or_add_callee(const Symbol &);
+  bool is_active() const { return start != UINT64_MAX; }
+  /* /suspended/, /blocked/ or /runnable/, time off cpu */
+  bool off_cpu() const;
   Func *call(const Symbol &, const Symbol &, Time);
   Func *ret(Time);
 
@@ -79,7 +117,28 @@ struct Func {
   void _flame_graph(std::ostream &, std::string, bool hide_zero);
   void flame_graph(std::ostream &);
 
+  uint32_t id() {
+    auto gen = symbol_generation.load(std::memory_order_relaxed);
+    if (sym_gen != gen) {
+      sym_id = intern_symbol(sym.name);
+      sym_gen = gen;
+    }
+    return sym_id;
+  }
+  uint64_t stack_hash() {
+    auto gen = generation.load(std::memory_order_relaxed);
+    if (hash_gen == gen) return hash;
+    uint64_t h = (caller ? caller->stack_hash() : 0) + id() * 0x9e3779b97f4a7c15;
+    h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9;
+    hash = h ^ (h >> 29);
+    hash_gen = gen;
+    return hash;
+  }
   Time self_time(); /* calculate self latency during invokes */
+  /* call graphs count the waker stack under an off cpu frame as the frame's
+     own time, since it is the blocked interval and not calls made */
+  bool graph_callee(const Func *c) const { return !off_cpu() || c->off_cpu(); }
+  Time graph_self_time();
   Func *find_callee(const Symbol &);
   Time last_time(); /* approximate return time of not-returned functions */
 
@@ -101,6 +160,46 @@ struct Func {
   }
 };
 
+/* replay mismatches, i.e. trace loss, broken down so that recording
+   settings can be compared */
+struct LossStats {
+  static inline Time bucket = 10000000; /* ns, for mismatches over time */
+  uint64_t total = 0;
+  uint64_t by_inst[Action::END + 1] = {};
+  std::unordered_map<std::string, uint64_t> by_symbol; /* top of stack */
+  std::map<size_t, uint64_t> by_tid;
+  std::map<Time, uint64_t> by_time;
+
+  void record(const Action &, const std::string &top);
+  /* with inferred time share of merged tree */
+  void report(std::ostream &, Func *root, uint64_t actions, size_t top_n);
+};
+
+/* pt-pmp: stacks of all threads sampled every interval of trace time,
+   identical stacks counted together by stack hash */
+struct StackSamples {
+  enum Format { PMP, FOLDED };
+  struct Entry {
+    uint64_t count = 0;
+    std::vector<uint32_t> ids; /* symbol ids, root first */
+  };
+  Time interval;
+  uint64_t samples = 0;
+  std::unordered_map<uint64_t, Entry> stacks;
+
+  StackSamples(Time interval): interval(interval) {}
+  void add(Func *top, uint64_t n);
+  /* pmp: count and frames leaf first, most frequent first.
+     folded: root first, for flamegraph.pl */
+  void write(std::ostream &, Format);
+};
+
+/* trace mode policies for History::replay. user only traces, e.g.
+   intel_pt//u, never see kernel symbols, so kernel mitigations and their
+   symbol name compares are compiled out */
+struct UserTrace { static constexpr bool kernel = false; };
+struct KernelTrace { static constexpr bool kernel = true; };
+
 class History {
   Func *root;
   Func *current;
@@ -119,6 +218,12 @@ class History {
   std::vector<std::string> try_match_stack;
   Time time;
 
+  /* scheduler sideband, off cpu interval is replayed at switch in */
+  Time switched_out = 0;
+  bool preempted = false;
+  Time woken = 0;
+  std::vector<Symbol> waker; /* stack of waking thread, root first */
+
   void make_new_root(const Symbol &);
   bool call(const Symbol &, const Symbol &, Time);
   bool ret(const Symbol &, const Symbol &, Time);
@@ -129,25 +234,99 @@ public:
   void print_status(std::ostream &os);
   History(const Symbol &, Time, size_t, size_t);
   History(const Action &a) : History(a.to, a.ts, a.cpu, a.tid) {}
-  bool replay(const Action &);
+  template <typename Mode> bool replay(const Action &);
   Func *terminate();
+  /* estimated end of open invocations if the thread stopped now */
+  Time last_time() { return pause_address ? pause_time : current->last_time(); }
+  const Func *tree() const { return root; }
+  Func *tree() { return root; }
+  const Func *top() const { return current; }
+  Func *top() { return current; }
+  std::vector<Symbol> stack(size_t max_depth) const; /* root first */
+  void switch_out(Time, bool preempted);
+  void wakeup(Time, std::vector<Symbol> &&waker);
+  /* adds /blocked/, with [wakeup] and waker stack below, and /runnable/
+     under current frame for time off cpu */
+  void switch_in(Time);
 };
 
 class Replay {
+public:
+  /* AUTO replays as USER until the first kernel address is seen */
+  enum Mode { AUTO, USER, KERNEL };
+
+private:
+  Mode mode;
   std::map<size_t, History> threads;
   std::map<size_t, Time> last_seen;
+  uint64_t unpublished = 0; /* replayed actions not yet in metrics */
+  uint64_t actions = 0;
+  StackSamples *samples = nullptr;
+  Time next_sample = UINT64_MAX; /* 0 until first action with samples */
+  void sample(Time);
+  /* stats of nodes already written to earlier cuts, only kept once cut.
+     slots of forgotten nodes are reused, all are dropped with reported_gen */
+  std::vector<Func::Statistics> reported;
+  std::vector<uint32_t> free_reported;
+  uint32_t reported_gen = 1;
+  Func::Statistics &add_reported(Func *);
+  void clear_reported() {
+    reported.clear();
+    free_reported.clear();
+    reported_gen++;
+  }
+  size_t reported_archive = 0; /* archived trees before are in earlier cuts */
+  Time last_cut = 0;
+  struct SliceNode;
+  void cut_node(SliceNode &, Func *, Time ts, Time changed);
   void stop_and_archive(size_t);
+  void sched(const Action &);
+  template <typename TraceMode> bool replay_as(const Action &);
 
 public:
-  ~Replay() { for (auto r: archive) delete r; }
+  Replay(Mode mode = AUTO): mode(mode) {}
+  ~Replay() {
+    metrics.replayed.fetch_add(unpublished, std::memory_order_relaxed);
+    for (auto r: archive) delete r;
+  }
   std::vector<Func *> archive;
-  bool replay(const Action &action);
+  LossStats loss;
+  uint64_t replayed() const { return actions; }
+  /* samples all threads every samples->interval, not owned */
+  void sample_stacks(StackSamples *s) {
+    samples = s;
+    next_sample = s ? 0 : UINT64_MAX;
+  }
+  bool replay(const Action &action) {
+    if (mode == AUTO && (action.from.is_kernel() || action.to.is_kernel())) {
+      std::cerr << "kernel address in trace, replay as kernel trace" << std::endl;
+      mode = KERNEL;
+    }
+    return mode == KERNEL ? replay_as<KernelTrace>(action)
+                          : replay_as<UserTrace>(action);
+  }
   void cleanup() {
     while (!threads.empty()) stop_and_archive(threads.begin()->first);
+    metrics.replayed.fetch_add(unpublished, std::memory_order_relaxed);
+    unpublished = 0;
   }
   Func *destructive_merge_all() {
+    clear_reported();
+    reported_archive = 0;
     return Func::destructive_merge_funcs(archive);
   }
+  /* aggregate since the previous cut, owned by caller. trees are left as
+     they are, so merging them at the end gives the same result as without
+     cuts. invocations are counted where they return, time of invocations
+     still open is split at the boundary */
+  Func *cut(Time);
+  /* cut that also drops archived trees and returned callees of live trees,
+     so memory stays bounded between takes. nothing before is merged at the
+     end */
+  Func *take(Time);
+  /* copy of archived and live trees merged, as destructive_merge_all
+     would return without stopping. owned by caller */
+  Func *merged_copy() const;
   void snapshot(std::ostream &, Time);
 };
 
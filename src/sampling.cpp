@@ -0,0 +1,54 @@
+#include <cmath>
+#include <functional>
+
+#include "replay.hpp"
+#include "sampling.hpp"
+
+SampleEstimate::~SampleEstimate() { delete total; }
+
+void SampleEstimate::add_unit(Func *unit) {
+  if (!unit) return;
+  units++;
+  std::function<void(Func *)> walk = [&](Func *f) {
+    double self = f->self_time();
+    if (self > 0) self_sq[f->stack_hash()] += self * self;
+    for (auto c: f->callee) walk(c);
+  };
+  walk(unit);
+  if (total) total->destructive_merge(unit);
+  else total = unit;
+}
+
+Func *SampleEstimate::finish() {
+  if (!total) return nullptr;
+  /* bottom up from scaled self time, so callers stay consistent with
+     their callees after rounding */
+  std::function<void(Func *)> scale = [&](Func *f) {
+    double self = f->self_time();
+    auto est = self / fraction;
+    if (est > 0) {
+      auto var = (1 - fraction) / (fraction * fraction) * self_sq[f->stack_hash()];
+      f->error = 196 * std::sqrt(var) / est;
+    }
+    Time sum = std::llround(est);
+    for (auto c: f->callee) {
+      scale(c);
+      sum += c->stats.sum_inferred;
+    }
+    auto &st = f->stats;
+    st.sum = st.sum_inferred ?
+             std::llround(static_cast<double>(st.sum) / st.sum_inferred * sum) : 0;
+    st.sum_inferred = sum;
+    st.invoked = std::llround(st.invoked / fraction);
+    st.inferred = std::min<size_t>(std::llround(st.inferred / fraction), st.invoked);
+  };
+  scale(total);
+  return total;
+}
+
+void SampleEstimate::summary(std::ostream &os) const {
+  os << "sample: " << units << " units replayed at fraction " << fraction
+     << ", scaled by " << 1 / fraction
+     << ", err:<pct>% is 95% confidence half width of frame self time"
+     << std::endl;
+}
@@ -0,0 +1,36 @@
+#ifndef __SAMPLING_HEADER__
+#define __SAMPLING_HEADER__
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <unordered_map>
+
+struct Func;
+
+/* scales back replay of a sampled subset, see ActionFilter::sample_below.
+   units are threads or time slices, each kept independently with
+   probability fraction, so totals are estimated as observed / fraction
+   (Horvitz-Thompson) and their variance from the spread over units */
+class SampleEstimate {
+  double fraction;
+  Func *total = nullptr;
+  size_t units = 0;
+  std::unordered_map<uint64_t, double> self_sq; /* by stack hash */
+
+public:
+  explicit SampleEstimate(double fraction): fraction(fraction) {}
+  ~SampleEstimate();
+  SampleEstimate(const SampleEstimate &) = delete;
+  SampleEstimate &operator=(const SampleEstimate &) = delete;
+
+  /* tree of one sampled unit under global root, consumed */
+  void add_unit(Func *);
+  /* scales merged tree and sets Func::error of every frame to the 95%
+     confidence half width of its self time, in percent. tree is owned
+     by estimate, nullptr if nothing was sampled */
+  Func *finish();
+  void summary(std::ostream &) const;
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#include "session_impl.hpp"
+
+namespace ptflame {
+
+uint64_t Frame::self() const {
+  uint64_t other = 0;
+  for (auto &c: callees) other += c.total;
+  return total > other ? total - other : 0;
+}
+
+static void write_string(std::ostream &os, const std::string &s) {
+  os << '"';
+  for (unsigned char c: s) {
+    if (c == '"' || c == '\\') os << '\\' << c;
+    else if (c < 0x20) {
+      static const char hex[] = "0123456789abcdef";
+      os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+    } else os << c;
+  }
+  os << '"';
+}
+
+static void write_folded(std::ostream &os, const Frame &f, std::string prefix) {
+  if (f.total == 0) return;
+  prefix += f.name;
+  os << prefix << ' ' << f.self() << '\n';
+  for (auto &c: f.callees) write_folded(os, c, prefix + ';');
+}
+
+static void write_json(std::ostream &os, const Frame &f) {
+  os << "{\"name\":";
+  write_string(os, f.name);
+  os << ",\"total\":" << f.total << ",\"self\":" << f.self()
+     << ",\"calls\":" << f.calls << ",\"inferred\":" << f.inferred
+     << ",\"callees\":[";
+  for (size_t i = 0; i < f.callees.size(); ++i) {
+    if (i) os << ',';
+    write_json(os, f.callees[i]);
+  }
+  os << "]}";
+}
+
+void Frame::write(std::ostream &os, Format format) const {
+  if (format == FOLDED) {
+    for (auto &c: callees) write_folded(os, c, "");
+    return;
+  }
+  os << '[';
+  for (size_t i = 0; i < callees.size(); ++i) {
+    if (i) os << ",\n";
+    write_json(os, callees[i]);
+  }
+  os << "]\n";
+}
+
+static Frame to_frame(const Func *f) {
+  Frame frame;
+  frame.name = f->sym.name;
+  frame.total = f->stats.sum_inferred;
+  frame.calls = f->stats.invoked;
+  frame.inferred = f->stats.inferred;
+  frame.callees.reserve(f->callee.size());
+  for (auto c: f->callee) frame.callees.push_back(to_frame(c));
+  return frame;
+}
+
+static Replay::Mode replay_mode(Session::Mode mode) {
+  switch (mode) {
+  case Session::USER: return Replay::USER;
+  case Session::KERNEL: return Replay::KERNEL;
+  default: return Replay::AUTO;
+  }
+}
+
+Session::Impl::Impl(const Options &opts): rp(replay_mode(opts.mode)) {
+  if (opts.sample_interval) {
+    samples.reset(new StackSamples(opts.sample_interval));
+    rp.sample_stacks(samples.get());
+  }
+}
+
+Session::Impl::~Impl() { delete root; }
+
+void Session::Impl::feed(const Action &action) {
+  rp.replay(action);
+  last_ts = action.ts;
+}
+
+void Session::Impl::feed(const Action *actions, size_t n) {
+  for (size_t i = 0; i < n; ++i) feed(actions[i]);
+}
+
+bool Session::Impl::parse(std::string &line) {
+  Action action;
+  try {
+    if (!TraceReader::parse_line(line, action)) return false;
+  } catch (...) {
+    std::cerr << "Error when reading line " << line << std::endl;
+    return false;
+  }
+  feed(action);
+  return true;
+}
+
+Func *Session::Impl::take(Time ts) { return rp.take(ts); }
+
+void Session::Impl::rotate(size_t max_symbols) {
+  rp.loss = LossStats();
+  if (samples) {
+    samples->stacks.clear();
+    samples->samples = 0;
+  }
+  if (interned_symbols() <= max_symbols) return;
+  reset_interned_symbols();
+  /* stack hashes are made of symbol ids */
+  Func::symbol_generation.fetch_add(1, std::memory_order_relaxed);
+  Func::generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Session::Impl::stop() {
+  if (stopped) return;
+  stopped = true;
+  rp.cleanup();
+}
+
+std::vector<Func *> Session::Impl::take_threads() {
+  stop();
+  /* archived roots keep tid of their thread */
+  std::map<size_t, Func *> threads;
+  for (auto r: rp.archive) {
+    auto &t = threads[r->tid];
+    if (t) t->destructive_merge(r);
+    else t = r;
+  }
+  rp.archive.clear();
+  std::vector<Func *> trees;
+  for (auto &[tid, t]: threads) trees.push_back(t);
+  return trees;
+}
+
+Func *Session::Impl::finish() {
+  if (root) return root;
+  stop();
+  root = rp.destructive_merge_all();
+  return root;
+}
+
+Session::Session(): Session(Options()) {}
+
+Session::Session(const Options &opts): impl(new Impl(opts)) {}
+
+Session::~Session() {}
+
+size_t Session::feed(const char *data, size_t len) {
+  size_t count = 0;
+  auto end = data + len;
+  while (data < end) {
+    auto nl = static_cast<const char *>(memchr(data, '\n', end - data));
+    if (!nl) {
+      impl->partial.append(data, end);
+      break;
+    }
+    impl->partial.append(data, nl);
+    count += impl->parse(impl->partial);
+    impl->partial.clear();
+    data = nl + 1;
+  }
+  return count;
+}
+
+uint64_t Session::actions() const { return impl->rp.replayed(); }
+
+uint64_t Session::last_time() const { return impl->last_ts; }
+
+void Session::cut(uint64_t ts, std::ostream &os) {
+  std::unique_ptr<Func> slice(impl->rp.cut(ts));
+  slice->flame_graph(os);
+}
+
+void Session::folded(std::ostream &os) {
+  if (impl->root) {
+    impl->root->flame_graph(os);
+    return;
+  }
+  std::unique_ptr<Func> copy(impl->rp.merged_copy());
+  copy->flame_graph(os);
+}
+
+Frame Session::snapshot() const {
+  if (impl->root) return to_frame(impl->root);
+  std::unique_ptr<Func> copy(impl->rp.merged_copy());
+  return to_frame(copy.get());
+}
+
+void Session::stacks(std::ostream &os, uint64_t ts) { impl->rp.snapshot(os, ts); }
+
+void Session::stack_samples(std::ostream &os, SampleFormat format) {
+  if (impl->samples)
+    impl->samples->write(os, format == PMP ? StackSamples::PMP
+                                           : StackSamples::FOLDED);
+}
+
+void Session::loss_report(std::ostream &os, size_t top_n) {
+  impl->rp.loss.report(os, impl->root, impl->rp.replayed(), top_n);
+}
+
+void Session::stop() { impl->stop(); }
+
+void Session::restart() {
+  if (!impl->stopped) impl->rp.cleanup();
+}
+
+Frame Session::result() {
+  auto root = impl->finish();
+  return root ? to_frame(root) : Frame();
+}
+
+} // namespace ptflame
@@ -0,0 +1,92 @@
+#ifndef __SESSION_HEADER__
+#define __SESSION_HEADER__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* the only installed header, so only standard types appear here. pt_flame
+   itself works on the replay trees through session_impl.hpp */
+namespace ptflame {
+
+/* aggregated call tree, a plain copy independent of the session */
+struct Frame {
+  enum Format {
+    FOLDED, /* name;name;name self_ns, for flamegraph.pl */
+    JSON /* nested objects, see write */
+  };
+
+  std::string name;
+  uint64_t total = 0; /* ns including callees */
+  uint64_t calls = 0;
+  uint64_t inferred = 0; /* calls with inferred call or return time */
+  std::vector<Frame> callees;
+
+  uint64_t self() const; /* ns not in callees */
+  /* the root is the synthetic global root, only its callees are written */
+  void write(std::ostream &, Format) const;
+};
+
+/* in-process replay of one trace, for embedding without pt_flame. raw perf
+   script text is fed in time order and aggregates can be taken while
+   feeding. global hooks (action_filter, symbol_index, perfetto, latency,
+   spans) apply as in pt_flame. not thread safe */
+class Session {
+public:
+  enum Mode { AUTO, USER, KERNEL }; /* AUTO is USER until a kernel address */
+  enum SampleFormat { PMP, FOLDED_SAMPLES }; /* see --pmp-format */
+  struct Options {
+    Mode mode = AUTO;
+    uint64_t sample_interval = 0; /* ns of trace time, 0 turns off stack_samples */
+  };
+  struct Impl;
+
+private:
+  std::unique_ptr<Impl> impl;
+
+public:
+  Session();
+  Session(const Options &);
+  ~Session();
+  Session(const Session &) = delete;
+  Session &operator=(const Session &) = delete;
+
+  /* raw perf script output, may end in the middle of a line which is kept
+     until the next call. returns number of actions replayed */
+  size_t feed(const char *, size_t);
+
+  uint64_t actions() const;
+  uint64_t last_time() const; /* ns, of last action fed */
+
+  /* writes aggregate since the previous cut in folded format, with call
+     counts as pt_flame. the session aggregate is not changed */
+  void cut(uint64_t, std::ostream &);
+  /* aggregate of invocations returned so far in folded format, as cut.
+     nothing is changed and feeding continues */
+  void folded(std::ostream &);
+  /* same aggregate as folded, as a tree */
+  Frame snapshot() const;
+  /* current stack of every thread, as pt_pstack */
+  void stacks(std::ostream &, uint64_t);
+  /* stacks of all threads sampled every sample_interval, see --pmp */
+  void stack_samples(std::ostream &, SampleFormat);
+  /* mismatches and inferred time so far, see --loss-report */
+  void loss_report(std::ostream &, size_t top_n = 20);
+
+  /* ends all open invocations, nothing can be fed afterwards */
+  void stop();
+  /* ends all open invocations at last action, feeding continues with fresh
+     stacks, e.g. for a new capture after a gap */
+  void restart();
+  /* stops and returns the aggregate of everything fed */
+  Frame result();
+
+  Impl &internal() { return *impl; }
+};
+
+} // namespace ptflame
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef __SESSION_IMPL_HEADER__
+#define __SESSION_IMPL_HEADER__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "reader.hpp"
+#include "replay.hpp"
+#include "session.hpp"
+
+namespace ptflame {
+
+/* replay behind Session, with parsed actions and Func trees, for pt_flame
+   and its daemon. not installed */
+struct Session::Impl {
+  Replay rp;
+  std::unique_ptr<StackSamples> samples;
+  Func *root = nullptr; /* merged by finish */
+  std::string partial; /* unterminated line of raw input */
+  Time last_ts = 0;
+  bool stopped = false;
+
+  explicit Impl(const Options &);
+  ~Impl();
+  Impl(const Impl &) = delete;
+  Impl &operator=(const Impl &) = delete;
+
+  void feed(const Action &);
+  void feed(const Action *, size_t);
+  bool parse(std::string &);
+  void stop();
+  /* closes current window at time and returns its aggregate, owned by
+     caller. only the active stacks are kept, see Replay::take */
+  Func *take(Time);
+  /* drops loss stats and stack samples gathered so far, and interned
+     symbols once there are more than max_symbols. only while no hook holds
+     symbol ids, i.e. in the daemon */
+  void rotate(size_t max_symbols);
+  /* stops and returns one tree per thread, owned by caller, with all trees
+     archived for a thread merged. windows already taken are not included */
+  std::vector<Func *> take_threads();
+  /* stops and merges all threads into one tree owned by session, for
+     CallGraph, Pprof and flame graph output. nullptr if nothing replayed */
+  Func *finish();
+};
+
+} // namespace ptflame
+
+#endif
@@ -0,0 +1,198 @@
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "metrics.hpp"
+#include "spans.hpp"
+#include "replay.hpp"
+
+SpanWriter *spans = nullptr;
+
+enum Encoding : uint8_t { VARINT = 0, DELTA, ZIGZAG, BYTE };
+enum Codec : uint8_t { RAW = 0, ZLIB };
+
+static const std::vector<std::pair<std::string, Encoding>> span_columns = {
+  {"tid", VARINT}, {"cpu", VARINT}, {"depth", ZIGZAG}, {"symbol", VARINT},
+  {"start", DELTA}, {"end", DELTA}, {"flags", BYTE}, {"id", DELTA},
+  {"parent", DELTA}
+};
+
+static void put_varint(std::string &buf, uint64_t v) {
+  while (v >= 0x80) {
+    buf.push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  buf.push_back(static_cast<char>(v));
+}
+
+static uint64_t zigzag(int64_t v) {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+template <typename T>
+static void put_raw(std::ostream &os, T v) {
+  os.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+SpanWriter::SpanWriter(const std::string &file)
+: os(file, std::ios::binary) {
+  emit_schema();
+  thr = std::thread(&SpanWriter::flush_worker, this);
+  pthread_setname_np(thr.native_handle(), "SpanWriter");
+}
+
+SpanWriter::~SpanWriter() {
+  for (auto s: shards) {
+    if (s->block && s->block->size()) submit(*s);
+    delete s->block;
+    delete s;
+  }
+  {
+    std::lock_guard<std::mutex> lg(lock);
+    stop = true;
+  }
+  full_empty.notify_one();
+  thr.join();
+  emit_dictionary();
+}
+
+SpanWriter::Shard &SpanWriter::local_shard() {
+  return local.get([this]() {
+    std::lock_guard<std::mutex> lg(lock);
+    shards.push_back(new Shard);
+    shards.back()->index = shards.size();
+    shards.back()->block = new Block;
+    return shards.back();
+  });
+}
+
+uint64_t SpanWriter::span_id(Func *f) {
+  if (!f->span_id) {
+    auto &s = local_shard();
+    f->span_id = (s.index << 48) | s.next_id++;
+  }
+  return f->span_id;
+}
+
+void SpanWriter::record(Func *f, Time ts) {
+  auto &s = local_shard();
+  auto &b = *s.block;
+  b.tid.push_back(f->tid);
+  b.cpu.push_back(s.cpu);
+  b.depth.push_back(f->depth);
+  b.sym.push_back(f->id());
+  b.start.push_back(f->start);
+  b.end.push_back(ts);
+  b.flags.push_back((f->start_is_inferred ? START_INFERRED : 0) |
+                    (f->end_is_inferred ? END_INFERRED : 0));
+  b.id.push_back(span_id(f));
+  b.parent.push_back(f->caller ? span_id(f->caller) : 0);
+  if (b.size() >= block_rows) submit(s);
+}
+
+void SpanWriter::submit(Shard &s) {
+  std::unique_lock<std::mutex> ul(lock);
+  /* back pressure, replay should not outrun compression unbounded */
+  if (full.size() >= max_pending_blocks) {
+    ScopedWait sw(Metrics::SPAN_WRITER);
+    full_drained.wait(ul, [this]() { return full.size() < max_pending_blocks; });
+  }
+  full.push(s.block);
+  ul.unlock();
+  full_empty.notify_one();
+  s.block = new Block;
+}
+
+void SpanWriter::flush_worker() {
+  while (true) {
+    std::unique_lock<std::mutex> ul(lock);
+    full_empty.wait(ul, [this]() { return !full.empty() || stop; });
+    if (full.empty()) return;
+    auto b = full.front();
+    full.pop();
+    ul.unlock();
+    full_drained.notify_all();
+    emit_block(b);
+    delete b;
+  }
+}
+
+/* layout, little endian:
+   header: "PTSPAN01", u32 columns, (u8 name length, name, u8 encoding) ...
+   block: "BLCK", u32 rows, (u8 codec, u32 raw size, u32 stored size, data) ...
+   dictionary: "DICT", u32 count, (u32 symbol id, u32 length, name) ...
+   encoding: 0 varint, 1 zigzag varint of delta to previous row (first row
+   to 0), 2 zigzag varint, 3 byte. codec: 0 raw, 1 zlib */
+void SpanWriter::emit_schema() {
+  os.write("PTSPAN01", 8);
+  put_raw<uint32_t>(os, span_columns.size());
+  for (auto &[name, enc]: span_columns) {
+    put_raw<uint8_t>(os, name.size());
+    os.write(name.c_str(), name.size());
+    put_raw<uint8_t>(os, enc);
+  }
+}
+
+void SpanWriter::emit_block(Block *b) {
+  auto encode = [](const std::vector<uint64_t> &vs, Encoding enc) {
+    std::string buf;
+    uint64_t prev = 0;
+    for (auto v: vs) {
+      if (enc == DELTA) {
+        put_varint(buf, zigzag(static_cast<int64_t>(v - prev)));
+        prev = v;
+      } else put_varint(buf, v);
+    }
+    return buf;
+  };
+  std::vector<std::string> cols;
+  cols.push_back(encode(b->tid, VARINT));
+  cols.push_back(encode(b->cpu, VARINT));
+  std::string depth;
+  for (auto d: b->depth) put_varint(depth, zigzag(d));
+  cols.push_back(std::move(depth));
+  cols.push_back(encode(b->sym, VARINT));
+  cols.push_back(encode(b->start, DELTA));
+  cols.push_back(encode(b->end, DELTA));
+  cols.push_back(std::string(b->flags.begin(), b->flags.end()));
+  cols.push_back(encode(b->id, DELTA));
+  cols.push_back(encode(b->parent, DELTA));
+
+  os.write("BLCK", 4);
+  put_raw<uint32_t>(os, b->size());
+  for (auto &col: cols) {
+#ifdef HAVE_ZLIB
+    uLongf size = compressBound(col.size());
+    std::string out(size, '\0');
+    if (compress(reinterpret_cast<Bytef *>(&out[0]), &size,
+                 reinterpret_cast<const Bytef *>(col.data()),
+                 col.size()) == Z_OK) {
+      put_raw<uint8_t>(os, ZLIB);
+      put_raw<uint32_t>(os, col.size());
+      put_raw<uint32_t>(os, size);
+      os.write(out.data(), size);
+      continue;
+    }
+#endif
+    put_raw<uint8_t>(os, RAW);
+    put_raw<uint32_t>(os, col.size());
+    put_raw<uint32_t>(os, col.size());
+    os.write(col.data(), col.size());
+  }
+}
+
+void SpanWriter::emit_dictionary() {
+  os.write("DICT", 4);
+  uint32_t count = interned_symbols() - 1;
+  put_raw<uint32_t>(os, count);
+  for (uint32_t id = 1; id <= count; ++id) {
+    auto &name = symbol_name(id);
+    put_raw<uint32_t>(os, id);
+    put_raw<uint32_t>(os, name.size());
+    os.write(name.c_str(), name.size());
+  }
+}
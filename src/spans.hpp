@@ -0,0 +1,72 @@
+#ifndef __SPANS_HEADER__
+#define __SPANS_HEADER__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "instance.hpp"
+#include "reader.hpp"
+
+struct Func;
+
+/* exports every returned invocation as a span to a block compressed columnar
+   file, see SpanWriter::emit_schema for layout. replay threads fill their own
+   block and hand it to a background thread for encoding and writing */
+class SpanWriter {
+public:
+  enum Flag : uint8_t { START_INFERRED = 1, END_INFERRED = 2 };
+
+private:
+  struct Block {
+    std::vector<uint64_t> tid, cpu, sym, start, end, id, parent;
+    std::vector<int64_t> depth;
+    std::vector<uint8_t> flags;
+    size_t size() const { return id.size(); }
+  };
+  struct Shard {
+    uint64_t index;
+    uint64_t next_id = 1;
+    size_t cpu = 0;
+    Block *block = nullptr;
+  };
+
+  std::ofstream os;
+  std::mutex lock;
+  std::vector<Shard *> shards;
+  InstanceLocal<Shard> local;
+
+  /* blocks waiting for background thread */
+  std::queue<Block *> full;
+  std::condition_variable full_empty;
+  std::condition_variable full_drained;
+  bool stop = false;
+  std::thread thr;
+
+  Shard &local_shard();
+  void submit(Shard &);
+  void flush_worker();
+  void emit_schema();
+  void emit_block(Block *);
+  void emit_dictionary();
+
+public:
+  static const size_t block_rows = 65536;
+  static const size_t max_pending_blocks = 16;
+
+  SpanWriter(const std::string &);
+  ~SpanWriter();
+  void set_cpu(size_t cpu) { local_shard().cpu = cpu; }
+  uint64_t span_id(Func *);
+  void record(Func *, Time);
+};
+
+extern SpanWriter *spans;
+
+#endif
@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
+#include "symbols.hpp"
+
+SymbolIndex *symbol_index = nullptr;
+
+void SymbolIndex::add(uint64_t start, uint64_t size, const std::string &name) {
+  if (!size) return;
+  if (!starts.empty() && start < starts.back()) sorted = false;
+  starts.push_back(start);
+  ranges.push_back({start + size, static_cast<uint32_t>(names.size())});
+  names.push_back(name);
+}
+
+void SymbolIndex::sort() {
+  if (sorted) return;
+  std::vector<size_t> order(starts.size());
+  std::iota(order.begin(), order.end(), 0);
+  /* later entries win at the same start, e.g. code JITed again */
+  std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+    return starts[a] < starts[b];
+  });
+  std::vector<uint64_t> s;
+  std::vector<Range> r;
+  for (auto i: order) {
+    if (!s.empty() && s.back() == starts[i]) {
+      r.back() = ranges[i];
+      continue;
+    }
+    s.push_back(starts[i]);
+    r.push_back(ranges[i]);
+  }
+  starts.swap(s);
+  ranges.swap(r);
+  sorted = true;
+  instance = new_instance_id();
+}
+
+bool SymbolIndex::load_perf_map(const std::string &file) {
+  std::ifstream is(file);
+  if (!is) return false;
+  std::string line;
+  size_t before = size();
+  while (std::getline(is, line)) {
+    /* names may contain spaces, e.g. "LazyCompile:*foo a.js:1" */
+    char *end;
+    auto start = std::strtoull(line.c_str(), &end, 16);
+    auto size = std::strtoull(end, &end, 16);
+    while (*end == ' ') end++;
+    if (*end) add(start, size, end);
+  }
+  std::cerr << "symbols: " << size() - before << " from " << file << std::endl;
+  return true;
+}
+
+bool SymbolIndex::load_elf(const std::string &file, uint64_t base) {
+  std::ifstream is(file, std::ios::binary);
+  if (!is) return false;
+  std::string data((std::istreambuf_iterator<char>(is)),
+                   std::istreambuf_iterator<char>());
+  if (data.size() < sizeof(Elf64_Ehdr) || memcmp(data.data(), ELFMAG, SELFMAG) ||
+      data[EI_CLASS] != ELFCLASS64) {
+    std::cerr << file << " is not a 64-bit ELF file" << std::endl;
+    return false;
+  }
+  auto in_file = [&](uint64_t off, uint64_t len) {
+    return off <= data.size() && len <= data.size() - off;
+  };
+  auto eh = reinterpret_cast<const Elf64_Ehdr *>(data.data());
+  if (!in_file(eh->e_shoff, eh->e_shnum * sizeof(Elf64_Shdr))) return false;
+  auto sh = reinterpret_cast<const Elf64_Shdr *>(data.data() + eh->e_shoff);
+  const Elf64_Shdr *symtab = nullptr;
+  for (size_t i = 0; i < eh->e_shnum; ++i) {
+    if (sh[i].sh_type == SHT_SYMTAB) symtab = &sh[i];
+    if (sh[i].sh_type == SHT_DYNSYM && !symtab) symtab = &sh[i];
+  }
+  if (!symtab || symtab->sh_link >= eh->e_shnum) {
+    std::cerr << file << " has no symbol table" << std::endl;
+    return false;
+  }
+  auto &strtab = sh[symtab->sh_link];
+  if (!in_file(symtab->sh_offset, symtab->sh_size) ||
+      !in_file(strtab.sh_offset, strtab.sh_size))
+    return false;
+  auto syms = reinterpret_cast<const Elf64_Sym *>(data.data() + symtab->sh_offset);
+  size_t before = size();
+  for (size_t i = 0; i < symtab->sh_size / sizeof(Elf64_Sym); ++i) {
+    auto &sym = syms[i];
+    if (ELF64_ST_TYPE(sym.st_info) != STT_FUNC || !sym.st_value ||
+        sym.st_name >= strtab.sh_size)
+      continue;
+    auto name = data.data() + strtab.sh_offset + sym.st_name;
+    add(base + sym.st_value, sym.st_size,
+        std::string(name, strnlen(name, strtab.sh_size - sym.st_name)));
+  }
+  std::cerr << "symbols: " << size() - before << " from " << file << std::endl;
+  return true;
+}
+
+bool SymbolIndex::load(const std::string &spec) {
+  bool ok;
+  if (!spec.empty() && spec.find_first_not_of("0123456789") == std::string::npos)
+    ok = load_perf_map("/tmp/perf-" + spec + ".map");
+  else if (spec.size() > 4 && spec.substr(spec.size() - 4) == ".map")
+    ok = load_perf_map(spec);
+  else {
+    auto at = spec.rfind('@');
+    uint64_t base = 0;
+    if (at != std::string::npos) base = std::stoull(spec.substr(at + 1), nullptr, 16);
+    ok = load_elf(spec.substr(0, at), base);
+  }
+  if (!ok) std::cerr << "Failed to load symbols from " << spec << std::endl;
+  sort();
+  return ok;
+}
+
+SymbolIndex::Hit SymbolIndex::lookup(uint64_t address) {
+  /* direct mapped by address, traces jump between few hot addresses */
+  static const size_t slots = 1024;
+  static const uint32_t none = UINT32_MAX;
+  thread_local struct {
+    uint64_t owner = 0;
+    uint64_t address[slots];
+    uint32_t index[slots];
+  } cache;
+  if (cache.owner != instance) {
+    std::fill(cache.address, cache.address + slots, UINT64_MAX);
+    cache.owner = instance;
+  }
+  auto slot = (address ^ address >> 10) % slots;
+  uint32_t idx;
+  if (cache.address[slot] == address) {
+    idx = cache.index[slot];
+  } else {
+    auto it = std::upper_bound(starts.begin(), starts.end(), address);
+    idx = none;
+    if (it != starts.begin()) {
+      size_t i = it - starts.begin() - 1;
+      if (address < ranges[i].end) idx = i;
+    }
+    cache.address[slot] = address;
+    cache.index[slot] = idx;
+  }
+  if (idx == none) return {nullptr, 0};
+  return {&names[ranges[idx].name], starts[idx]};
+}
@@ -0,0 +1,50 @@
+#ifndef __SYMBOLS_HEADER__
+#define __SYMBOLS_HEADER__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "instance.hpp"
+
+/* address ranges of symbols perf script could not resolve, e.g. JIT code from
+   /tmp/perf-<pid>.map or stripped binaries with a separate symbol file.
+   loaded before readers start and read-only afterwards */
+class SymbolIndex {
+  struct Range {
+    uint64_t end;
+    uint32_t name;
+  };
+  /* split so that binary search only touches starts */
+  std::vector<uint64_t> starts;
+  std::vector<Range> ranges;
+  std::vector<std::string> names;
+  bool sorted = true;
+  uint64_t instance = new_instance_id(); /* renewed when ranges change */
+
+  void add(uint64_t start, uint64_t size, const std::string &);
+  void sort();
+
+public:
+  struct Hit {
+    const std::string *name;
+    uint64_t start;
+  };
+
+  /* perf map, one "START SIZE name" line per symbol in hex */
+  bool load_perf_map(const std::string &);
+  /* function symbols of ELF file, .symtab or else .dynsym, relocated by base
+     for shared objects and PIE */
+  bool load_elf(const std::string &, uint64_t base = 0);
+  /* "<pid>" for /tmp/perf-<pid>.map, "<file>.map", or "<elf>[@base]" */
+  bool load(const std::string &);
+
+  size_t size() const { return starts.size(); }
+  /* name is nullptr if address is not covered, cached per thread */
+  Hit lookup(uint64_t address);
+};
+
+/* [unknown] symbols are not resolved if not set */
+extern SymbolIndex *symbol_index;
+
+#endif
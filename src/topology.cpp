@@ -0,0 +1,137 @@
+#include <fstream>
+#include <iostream>
+#include <sched.h>
+#include <set>
+#include <sstream>
+
+#include "topology.hpp"
+
+Placement placement;
+
+std::vector<int> parse_cpu_list(const std::string &str) {
+  std::vector<int> ret;
+  std::istringstream is(str);
+  std::string range;
+  while (std::getline(is, range, ',')) {
+    if (range.empty() || range == "\n") continue;
+    auto dash = range.find('-');
+    int lo = std::stoi(range.substr(0, dash));
+    int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+    for (int c = lo; c <= hi; ++c) ret.push_back(c);
+  }
+  return ret;
+}
+
+std::string format_cpu_list(const std::vector<int> &cpus) {
+  std::ostringstream os;
+  for (size_t i = 0; i < cpus.size(); ++i) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) j++;
+    if (i) os << ',';
+    os << cpus[i];
+    if (j > i) os << '-' << cpus[j];
+    i = j;
+  }
+  return os.str();
+}
+
+static std::string read_line(const std::string &file) {
+  std::ifstream is(file);
+  std::string line;
+  std::getline(is, line);
+  return line;
+}
+
+void Placement::load_nodes() {
+  if (!nodes.empty()) return;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  static const std::string sys = "/sys/devices/system/node/";
+  auto online = read_line(sys + "online");
+  if (!online.empty()) {
+    for (auto id: parse_cpu_list(online)) {
+      Node n{id, {}};
+      auto path = sys + "node" + std::to_string(id) + "/cpulist";
+      for (auto c: parse_cpu_list(read_line(path)))
+        if (CPU_ISSET(c, &allowed)) n.cpus.push_back(c);
+      if (!n.cpus.empty()) nodes.push_back(n);
+    }
+  }
+  if (nodes.empty()) {
+    /* no NUMA info, e.g. kernel without CONFIG_NUMA */
+    Node n{0, {}};
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+      if (CPU_ISSET(c, &allowed)) n.cpus.push_back(c);
+    nodes.push_back(n);
+  }
+}
+
+int Placement::node_of(int cpu) {
+  for (auto &n: nodes)
+    for (auto c: n.cpus)
+      if (c == cpu) return n.id;
+  return -1;
+}
+
+bool Placement::pin(const std::string &role, size_t group, size_t worker,
+                    const std::vector<int> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto c: cpus) CPU_SET(c, &set);
+  /* pid 0 is the calling thread */
+  if (sched_setaffinity(0, sizeof(set), &set)) {
+    std::cerr << "Failed to pin " << role << " to cpus "
+              << format_cpu_list(cpus) << std::endl;
+    return false;
+  }
+  pins.push_back({role, group, worker, cpus});
+  return true;
+}
+
+size_t Placement::new_group() {
+  std::lock_guard<std::mutex> lg(lock);
+  return groups++;
+}
+
+void Placement::pin_reader(size_t group, size_t worker) {
+  if (!enabled()) return;
+  std::lock_guard<std::mutex> lg(lock);
+  load_nodes();
+  if (!reader_cpus.empty()) {
+    pin("reader", group, worker,
+        {reader_cpus[next_reader_cpu++ % reader_cpus.size()]});
+  } else if (numa) {
+    /* whole node, scheduler balances workers of a group inside it */
+    pin("reader", group, worker, nodes[group % nodes.size()].cpus);
+  }
+}
+
+void Placement::pin_main() {
+  if (!enabled()) return;
+  std::lock_guard<std::mutex> lg(lock);
+  load_nodes();
+  if (!main_cpus.empty()) pin("main", 0, 0, main_cpus);
+  else if (numa) pin("main", 0, 0, nodes[0].cpus);
+}
+
+void Placement::report(std::ostream &os) {
+  std::lock_guard<std::mutex> lg(lock);
+  load_nodes();
+  os << ",\n  \"topology\": {\"nodes\": [";
+  for (size_t i = 0; i < nodes.size(); ++i)
+    os << (i ? ", " : "") << "{\"node\": " << nodes[i].id << ", \"cpus\": \""
+       << format_cpu_list(nodes[i].cpus) << "\"}";
+  os << "],\n    \"threads\": [";
+  for (size_t i = 0; i < pins.size(); ++i) {
+    auto &p = pins[i];
+    std::set<int> ns;
+    for (auto c: p.cpus) ns.insert(node_of(c));
+    os << (i ? "," : "") << "\n      {\"role\": \"" << p.role
+       << "\", \"group\": " << p.group << ", \"worker\": " << p.worker
+       << ", \"cpus\": \"" << format_cpu_list(p.cpus) << "\", \"node\": "
+       << (ns.size() == 1 ? *ns.begin() : -1) << "}";
+  }
+  os << "\n    ]}";
+}
@@ -0,0 +1,56 @@
+#ifndef __TOPOLOGY_HEADER__
+#define __TOPOLOGY_HEADER__
+
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* "0-3,8,10-11" */
+std::vector<int> parse_cpu_list(const std::string &);
+std::string format_cpu_list(const std::vector<int> &);
+
+/* pins pipeline threads to cpus. threads pin themselves before allocating,
+   so their buffers are first touched, and placed, on their own node.
+   readers are groups, workers of a group stay on one node with --numa */
+class Placement {
+public:
+  struct Node {
+    int id;
+    std::vector<int> cpus; /* restricted to cpus this process may use */
+  };
+
+private:
+  std::mutex lock;
+  std::vector<Node> nodes;
+  size_t groups = 0;
+  size_t next_reader_cpu = 0;
+  struct Pin {
+    std::string role;
+    size_t group;
+    size_t worker;
+    std::vector<int> cpus;
+  };
+  std::vector<Pin> pins;
+
+  void load_nodes();
+  bool pin(const std::string &, size_t, size_t, const std::vector<int> &);
+  int node_of(int cpu);
+
+public:
+  std::vector<int> reader_cpus; /* one worker per cpu, round robin */
+  std::vector<int> main_cpus; /* merge and replay */
+  bool numa = false; /* spread reader groups over nodes */
+
+  bool enabled() const {
+    return numa || !reader_cpus.empty() || !main_cpus.empty();
+  }
+  size_t new_group();
+  void pin_reader(size_t group, size_t worker);
+  void pin_main();
+  void report(std::ostream &); /* json members for Metrics::extra */
+};
+
+extern Placement placement;
+
+#endif